@@ -0,0 +1,91 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "ray.h"
+
+#include <algorithm>
+
+// Axis-aligned bounding box
+class aabb {
+public:
+    point3 minimum;
+    point3 maximum;
+
+    // An empty box: growing it by anything yields that thing's bounds
+    aabb() : minimum(infinity, infinity, infinity), maximum(-infinity, -infinity, -infinity) {}
+    aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+    point3 min() const { return minimum; }
+    point3 max() const { return maximum; }
+
+    bool empty() const {
+        return minimum.x() > maximum.x() || minimum.y() > maximum.y() || minimum.z() > maximum.z();
+    }
+
+    point3 centroid() const { return 0.5f * (minimum + maximum); }
+
+    float surface_area() const {
+        if (empty())
+            return 0.0f;
+        vec3 d = maximum - minimum;
+        return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
+    // Axis of the largest extent
+    int longest_axis() const {
+        vec3 d = maximum - minimum;
+        if (d.x() > d.y() && d.x() > d.z())
+            return 0;
+        return d.y() > d.z() ? 1 : 2;
+    }
+
+    void grow(const point3& p) {
+#ifdef VEC3_SSE
+        // minps and maxps pick their second operand unless the first is
+        // strictly beyond it, as std::min and std::max do
+        minimum = vec3(_mm_min_ps(p.m, minimum.m));
+        maximum = vec3(_mm_max_ps(p.m, maximum.m));
+#else
+        for (int a = 0; a < 3; a++) {
+            minimum[a] = std::min(minimum[a], p[a]);
+            maximum[a] = std::max(maximum[a], p[a]);
+        }
+#endif
+    }
+
+    void grow(const aabb& box) {
+#ifdef VEC3_SSE
+        minimum = vec3(_mm_min_ps(box.minimum.m, minimum.m));
+        maximum = vec3(_mm_max_ps(box.maximum.m, maximum.m));
+#else
+        for (int a = 0; a < 3; a++) {
+            minimum[a] = std::min(minimum[a], box.minimum[a]);
+            maximum[a] = std::max(maximum[a], box.maximum[a]);
+        }
+#endif
+    }
+
+    // Slab test
+    bool hit(const ray& r, float t_min, float t_max) const {
+        for (int a = 0; a < 3; a++) {
+            auto invD = 1.0f / r.direction()[a];
+            auto t0 = (minimum[a] - r.origin()[a]) * invD;
+            auto t1 = (maximum[a] - r.origin()[a]) * invD;
+            if (invD < 0.0f)
+                std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max <= t_min)
+                return false;
+        }
+        return true;
+    }
+};
+
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+    aabb box = box0;
+    box.grow(box1);
+    return box;
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include "hittable.h"
+#include "rayPacket.h"
+
+#include <cstddef>
+#include <vector>
+
+// Acceleration structures the renderer can put over the scene
+enum class Accelerator {
+    // brute force: hittableList::hit over every object
+    List,
+    // binary BVH built with the binned surface area heuristic
+    BVH,
+    // the same tree collapsed to 4 children per node, tested with SIMD
+    BVH4,
+    // BVH4 with 64-byte nodes holding 8-bit quantized child bounds
+    BVH4Quantized,
+    // uniform grid walked with a 3D-DDA
+    Grid,
+    // brute force over the spheres copied into a SIMD-tested sphereStore
+    SphereList
+};
+
+// How the BVH topology is built
+enum class BvhBuilder {
+    // top-down binned SAH, single threaded
+    SAH,
+    // linear BVH: Morton-sorted radix tree, built in parallel
+    LBVH,
+    // LBVH followed by a treelet restructuring pass that lowers its SAH cost
+    LBVHTreelet
+};
+
+// How BVH leaves hold their primitives
+enum class LeafFormat {
+    // pointers to the objects, each tested through its virtual hit
+    Objects,
+    // The spheres copied in leaf order into a sphereStore, so a leaf is one
+    // batch test. Only taken when every bounded object is a sphere;
+    // otherwise the leaves hold Objects.
+    Spheres
+};
+
+// Build-time figures of an acceleration structure
+struct AccelStats {
+    double buildMs = 0.0;
+    int nodes = 0;
+    int leaves = 0;
+    int maxDepth = 0;
+    size_t bytes = 0;
+    // SAH cost of the current tree relative to a root visit
+    float sahCost = 0.0f;
+    // Incremental updates since the last full build
+    int refits = 0;
+    double lastRefitMs = 0.0;
+    // Full rebuilds triggered because refitting had degraded the tree
+    int rebuilds = 0;
+};
+
+// An acceleration structure built over a list of objects, which it refers to
+// by their index in that list
+class accelStructure : public hittable {
+public:
+    // Call after moving or resizing the given objects in place. Returns true
+    // if the structure was rebuilt from scratch rather than updated.
+    virtual bool refit(const std::vector<int>& objectIndices) = 0;
+    virtual const AccelStats& stats() const = 0;
+
+    // Closest hits of every ray of the packet: hits[i] tells whether ray i
+    // hit anything and recs[i] what. Structures that can share traversal
+    // between coherent rays override this; the default traces them one by one.
+    virtual void hit_packet(const rayPacket& packet, float t_min, float t_max, hit_record* recs, bool* hits) const {
+        for (int i = 0; i < packet.count; i++)
+            hits[i] = hit(packet.get(i), t_min, t_max, recs[i]);
+    }
+};
+
+// Work done during traversal. Each thread counts into its own set, which the
+// renderer collects after every tile.
+struct TraversalCounters {
+    long long rays = 0;
+    long long nodes = 0;
+    long long prims = 0;
+};
+
+inline TraversalCounters& traversal_counters() {
+    static thread_local TraversalCounters counters;
+    return counters;
+}
+
+#endif
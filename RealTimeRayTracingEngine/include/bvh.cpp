@@ -0,0 +1,417 @@
+#include "bvh.h"
+#include "dispatch.h"
+
+#include <algorithm>
+#include <chrono>
+
+bvh::bvh(const std::vector<shared_ptr<hittable>>& objects, int maxLeafSize, BvhBuilder builder, ThreadPool* pool,
+         LeafFormat leafFormat)
+    : objects(objects), leafFormat(leafFormat), sphereLeaves(false),
+      maxLeafSize(std::max(1, std::min(maxLeafSize, 255))), builder(builder), pool(pool) {
+    buildAll();
+}
+
+void bvh::buildAll() {
+    auto start = std::chrono::steady_clock::now();
+
+    nodes.clear();
+    prims.clear();
+    primIndices.clear();
+    unbounded.clear();
+    int refits = buildStats.refits, rebuilds = buildStats.rebuilds;
+    buildStats = AccelStats();
+    buildStats.refits = refits;
+    buildStats.rebuilds = rebuilds;
+
+    std::vector<buildPrim> work;
+    work.reserve(objects.size());
+    for (size_t i = 0; i < objects.size(); i++) {
+        objects[i]->clear_dirty();
+        buildPrim p;
+        if (!objects[i]->bounding_box(p.box)) {
+            unbounded.push_back(objects[i]);
+            continue;
+        }
+        p.centroid = p.box.centroid();
+        p.index = static_cast<int>(i);
+        work.push_back(p);
+    }
+
+    if (!work.empty()) {
+        if (builder == BvhBuilder::SAH) {
+            nodes.reserve(2 * work.size() / maxLeafSize + 1);
+            primIndices.reserve(work.size());
+            build(work, 0, static_cast<int>(work.size()), 0);
+        } else {
+            buildLinear(work);
+            // treelet restructuring can deepen the tree; keep traversal within its stack
+            if (buildStats.maxDepth > MAX_DEPTH) {
+                nodes.clear();
+                primIndices.clear();
+                buildStats.leaves = 0;
+                buildStats.maxDepth = 0;
+                build(work, 0, static_cast<int>(work.size()), 0);
+            }
+        }
+
+        prims.reserve(primIndices.size());
+        for (int index : primIndices)
+            prims.push_back(objects[index]);
+    }
+
+    leafSpheres.clear();
+    sphereLeaves = leafFormat == LeafFormat::Spheres && !prims.empty();
+    for (size_t i = 0; i < prims.size() && sphereLeaves; i++)
+        sphereLeaves = prims[i]->kind() == HittableKind::Sphere;
+    if (sphereLeaves) {
+        leafSpheres.reserve(prims.size());
+        for (const auto &prim : prims)
+            leafSpheres.add(static_cast<const sphere&>(*prim));
+    }
+
+    // bookkeeping for refits
+    parents.assign(nodes.size(), -1);
+    primLeaf.assign(prims.size(), -1);
+    primSlot.assign(objects.size(), -1);
+    sahSum = 0.0;
+    for (size_t n = 0; n < nodes.size(); n++) {
+        const node& nd = nodes[n];
+        sahSum += nodeCost(nd);
+        if (nd.count > 0) {
+            for (int i = 0; i < nd.count; i++) {
+                primLeaf[nd.offset + i] = static_cast<int>(n);
+                primSlot[primIndices[nd.offset + i]] = nd.offset + i;
+            }
+        } else {
+            parents[n + 1] = static_cast<int>(n);
+            parents[nd.offset] = static_cast<int>(n);
+        }
+    }
+    builtCost = currentCost();
+
+    buildStats.nodes = static_cast<int>(nodes.size());
+    buildStats.sahCost = builtCost;
+    buildStats.bytes = nodes.size() * sizeof(node) + prims.size() * sizeof(shared_ptr<hittable>);
+    if (sphereLeaves)
+        buildStats.bytes += leafSpheres.bytes();
+    buildStats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static float nodeArea(const bvh::node& n) {
+    float dx = n.hi[0] - n.lo[0], dy = n.hi[1] - n.lo[1], dz = n.hi[2] - n.lo[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+double bvh::nodeCost(const node& n) const {
+    return nodeArea(n) * (n.count > 0 ? INTERSECT_COST * n.count : TRAVERSAL_COST);
+}
+
+float bvh::currentCost() const {
+    if (nodes.empty())
+        return 0.0f;
+    float rootArea = nodeArea(nodes[0]);
+    return rootArea > 0.0f ? static_cast<float>(sahSum / rootArea) : 0.0f;
+}
+
+bool bvh::refit(const std::vector<int>& objectIndices) {
+    auto start = std::chrono::steady_clock::now();
+
+    for (int index : objectIndices) {
+        if (index < 0 || index >= static_cast<int>(objects.size()))
+            continue;
+        objects[index]->clear_dirty();
+        int slot = primSlot[index];
+        if (slot < 0)
+            continue;
+        if (sphereLeaves)
+            leafSpheres.update(slot, static_cast<const sphere&>(*prims[slot]));
+
+        // the leaf takes the union of its primitives, every ancestor the union of its children
+        int current = primLeaf[slot];
+        while (current >= 0) {
+            node& n = nodes[current];
+            aabb box;
+            if (n.count > 0) {
+                aabb primBox;
+                for (int i = 0; i < n.count; i++) {
+                    prims[n.offset + i]->bounding_box(primBox);
+                    box.grow(primBox);
+                }
+            } else {
+                const node& left = nodes[current + 1];
+                const node& right = nodes[n.offset];
+                box.grow(point3(left.lo[0], left.lo[1], left.lo[2]));
+                box.grow(point3(left.hi[0], left.hi[1], left.hi[2]));
+                box.grow(point3(right.lo[0], right.lo[1], right.lo[2]));
+                box.grow(point3(right.hi[0], right.hi[1], right.hi[2]));
+            }
+
+            bool changed = false;
+            for (int a = 0; a < 3; a++)
+                changed |= n.lo[a] != box.minimum[a] || n.hi[a] != box.maximum[a];
+            // nothing above can change either
+            if (!changed)
+                break;
+
+            sahSum -= nodeCost(n);
+            for (int a = 0; a < 3; a++) {
+                n.lo[a] = box.minimum[a];
+                n.hi[a] = box.maximum[a];
+            }
+            sahSum += nodeCost(n);
+            current = parents[current];
+        }
+    }
+
+    buildStats.refits++;
+    buildStats.sahCost = currentCost();
+    bool rebuild = buildStats.sahCost > builtCost * REBUILD_RATIO;
+    if (rebuild) {
+        buildStats.rebuilds++;
+        buildAll();
+    }
+    buildStats.lastRefitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return rebuild;
+}
+
+int bvh::makeLeaf(std::vector<buildPrim>& work, int begin, int end, const aabb& bounds) {
+    int index = static_cast<int>(nodes.size());
+    node n;
+    for (int a = 0; a < 3; a++) {
+        n.lo[a] = bounds.minimum[a];
+        n.hi[a] = bounds.maximum[a];
+    }
+    n.offset = static_cast<int>(primIndices.size());
+    n.count = static_cast<uint16_t>(end - begin);
+    n.axis = 0;
+    nodes.push_back(n);
+    buildStats.leaves++;
+
+    for (int i = begin; i < end; i++)
+        primIndices.push_back(work[i].index);
+    return index;
+}
+
+int bvh::build(std::vector<buildPrim>& work, int begin, int end, int depth) {
+    buildStats.maxDepth = std::max(buildStats.maxDepth, depth);
+
+    aabb bounds, centroidBounds;
+    for (int i = begin; i < end; i++) {
+        bounds.grow(work[i].box);
+        centroidBounds.grow(work[i].centroid);
+    }
+
+    int count = end - begin;
+    if (count == 1)
+        return makeLeaf(work, begin, end, bounds);
+
+    // Evaluate BINS-1 split planes per axis; each side costs its primitive
+    // count weighted by the chance (area ratio) that a ray entering this node
+    // also enters that side
+    float bestCost = infinity;
+    int bestAxis = -1, bestSplit = 0;
+    float parentArea = bounds.surface_area();
+
+    for (int axis = 0; axis < 3; axis++) {
+        float cmin = centroidBounds.minimum[axis];
+        float extent = centroidBounds.maximum[axis] - cmin;
+        if (extent <= 0.0f)
+            continue;
+
+        int binCount[BINS] = {};
+        aabb binBox[BINS];
+        float scale = BINS / extent;
+        for (int i = begin; i < end; i++) {
+            int b = std::min(BINS - 1, static_cast<int>((work[i].centroid[axis] - cmin) * scale));
+            binCount[b]++;
+            binBox[b].grow(work[i].box);
+        }
+
+        float rightArea[BINS];
+        int rightCount[BINS];
+        aabb acc;
+        int n = 0;
+        for (int b = BINS - 1; b > 0; b--) {
+            acc.grow(binBox[b]);
+            n += binCount[b];
+            rightArea[b] = acc.surface_area();
+            rightCount[b] = n;
+        }
+
+        acc = aabb();
+        n = 0;
+        for (int b = 0; b < BINS - 1; b++) {
+            acc.grow(binBox[b]);
+            n += binCount[b];
+            if (n == 0 || rightCount[b + 1] == 0)
+                continue;
+            float cost = TRAVERSAL_COST
+                + INTERSECT_COST * (n * acc.surface_area() + rightCount[b + 1] * rightArea[b + 1]) / parentArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    float leafCost = INTERSECT_COST * count;
+    if (count <= maxLeafSize && (bestAxis < 0 || leafCost <= bestCost))
+        return makeLeaf(work, begin, end, bounds);
+
+    int mid;
+    if (bestAxis >= 0 && depth < MAX_DEPTH) {
+        int axis = bestAxis;
+        float cmin = centroidBounds.minimum[axis];
+        float scale = BINS / (centroidBounds.maximum[axis] - cmin);
+        int split = bestSplit;
+        mid = static_cast<int>(std::partition(work.begin() + begin, work.begin() + end, [&](const buildPrim& p) {
+            return std::min(BINS - 1, static_cast<int>((p.centroid[axis] - cmin) * scale)) <= split;
+        }) - work.begin());
+    } else {
+        // coincident centroids or a very deep tree: split the range in half
+        bestAxis = centroidBounds.longest_axis();
+        mid = begin + count / 2;
+        int axis = bestAxis;
+        std::nth_element(work.begin() + begin, work.begin() + mid, work.begin() + end,
+            [axis](const buildPrim& a, const buildPrim& b) { return a.centroid[axis] < b.centroid[axis]; });
+    }
+
+    int index = static_cast<int>(nodes.size());
+    node n;
+    for (int a = 0; a < 3; a++) {
+        n.lo[a] = bounds.minimum[a];
+        n.hi[a] = bounds.maximum[a];
+    }
+    n.count = 0;
+    n.axis = static_cast<uint16_t>(bestAxis);
+    nodes.push_back(n);
+
+    build(work, begin, mid, depth + 1);
+    int right = build(work, mid, end, depth + 1);
+    nodes[index].offset = right;
+    return index;
+}
+
+bool bvh::bounding_box(aabb& output_box) const {
+    if (nodes.empty() || !unbounded.empty())
+        return false;
+    const node& root = nodes[0];
+    output_box = aabb(point3(root.lo[0], root.lo[1], root.lo[2]), point3(root.hi[0], root.hi[1], root.hi[2]));
+    return true;
+}
+
+bool bvh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (!traverse<false>(r, t_min, t_max, &rec))
+        return false;
+    complete_record(r, rec);
+    return true;
+}
+
+bool bvh::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return traverse<false>(r, t_min, t_max, &rec);
+}
+
+void bvh::fill_record(const ray& r, hit_record& rec) const {
+    leafSpheres.fill_record(rec.prim, r, rec.t, rec);
+}
+
+bool bvh::occluded(const ray& r, float t_min, float t_max) const {
+    return traverse<true>(r, t_min, t_max, nullptr);
+}
+
+template <bool AnyHit>
+bool bvh::traverse(const ray& r, float t_min, float t_max, hit_record* rec) const {
+    TraversalCounters& counters = traversal_counters();
+    bool closedSet = closed_set_dispatch();
+    counters.rays++;
+
+    bool hit_anything = false;
+    float closest = t_max;
+
+    for (const auto &object : unbounded) {
+        counters.prims++;
+        if (AnyHit) {
+            if (occluded_object(*object, closedSet, r, t_min, closest))
+                return true;
+        } else if (intersect_object(*object, closedSet, r, t_min, closest, *rec)) {
+            hit_anything = true;
+            closest = rec->t;
+        }
+    }
+    if (nodes.empty())
+        return hit_anything;
+
+    float origin[3], invDir[3];
+    bool dirNeg[3];
+    for (int a = 0; a < 3; a++) {
+        origin[a] = r.origin()[a];
+        invDir[a] = 1.0f / r.direction()[a];
+        dirNeg[a] = invDir[a] < 0.0f;
+    }
+
+    // with sphere leaves only the final hit goes into the record
+    int sphereHit = -1;
+    int stack[STACK_SIZE];
+    int sp = 0;
+    int current = 0;
+    while (true) {
+        const node& n = nodes[current];
+        counters.nodes++;
+
+        // slab test against the current closest hit
+        float t0 = t_min, t1 = closest;
+        for (int a = 0; a < 3; a++) {
+            float tNear = (n.lo[a] - origin[a]) * invDir[a];
+            float tFar = (n.hi[a] - origin[a]) * invDir[a];
+            if (dirNeg[a])
+                std::swap(tNear, tFar);
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar < t1 ? tFar : t1;
+        }
+
+        if (t0 <= t1) {
+            if (n.count > 0 && sphereLeaves) {
+                counters.prims += n.count;
+                int found = leafSpheres.nearest(r, n.offset, n.offset + n.count, t_min, closest);
+                if (found >= 0) {
+                    if (AnyHit)
+                        return true;
+                    sphereHit = found;
+                }
+            } else if (n.count > 0) {
+                for (int i = 0; i < n.count; i++) {
+                    counters.prims++;
+                    if (AnyHit) {
+                        if (occluded_object(*prims[n.offset + i], closedSet, r, t_min, closest))
+                            return true;
+                    } else if (intersect_object(*prims[n.offset + i], closedSet, r, t_min, closest, *rec)) {
+                        hit_anything = true;
+                        closest = rec->t;
+                    }
+                }
+            } else {
+                // visit the child on the near side of the split first
+                if (dirNeg[n.axis]) {
+                    stack[sp++] = current + 1;
+                    current = n.offset;
+                } else {
+                    stack[sp++] = n.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+
+        if (sp == 0)
+            break;
+        current = stack[--sp];
+    }
+    if (!AnyHit && sphereHit >= 0) {
+        rec->t = closest;
+        rec->object = this;
+        rec->prim = sphereHit;
+        hit_anything = true;
+    }
+    return hit_anything;
+}
@@ -0,0 +1,127 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "hittable.h"
+#include "accelerator.h"
+#include "sphereStore.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using std::shared_ptr;
+
+class ThreadPool;
+
+// Bounding volume hierarchy over a fixed set of objects, built top-down with
+// the binned surface area heuristic or as a linear BVH from Morton codes.
+// Nodes live in one array in depth-first order: an interior node's first
+// child directly follows it.
+class bvh : public accelStructure
+{
+public:
+    struct node {
+        float lo[3], hi[3];
+        // leaf: index of its first primitive; interior: index of the second child
+        int offset;
+        // primitives in a leaf, 0 for interior nodes
+        uint16_t count;
+        // split axis of an interior node
+        uint16_t axis;
+    };
+
+    // The linear builders spread their work over pool when one is given; it
+    // must outlive the tree, which also uses it for rebuilds.
+    explicit bvh(const std::vector<shared_ptr<hittable>>& objects, int maxLeafSize = 4,
+                 BvhBuilder builder = BvhBuilder::SAH, ThreadPool* pool = nullptr,
+                 LeafFormat leafFormat = LeafFormat::Spheres);
+
+    // Updates the bounds along the paths from the leaves holding the given
+    // objects (indices into the constructor's list) to the root, and clears
+    // their dirty flags. Refitting never changes the topology, so if the
+    // SAH cost has grown past REBUILD_RATIO times the built cost, the tree
+    // is rebuilt instead. Returns true if it was.
+    virtual bool refit(const std::vector<int>& objectIndices) override;
+    virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual void fill_record(const ray& r, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+    // Traverses once for the whole packet, testing each node against all its
+    // rays with SIMD after a frustum test that can skip it for all of them at
+    // once. Needs the rays to agree on direction signs; other packets are
+    // traced ray by ray. In bvhPacket.cpp.
+    virtual void hit_packet(const rayPacket& packet, float t_min, float t_max, hit_record* recs,
+                            bool* hits) const override;
+    virtual bool bounding_box(aabb& output_box) const override;
+
+    virtual const AccelStats& stats() const override { return buildStats; }
+    const std::vector<node>& get_nodes() const { return nodes; }
+    const std::vector<shared_ptr<hittable>>& get_prims() const { return prims; }
+    const std::vector<shared_ptr<hittable>>& get_unbounded() const { return unbounded; }
+    // The leaf holding object index (into the constructor's list), -1 if
+    // it is unbounded
+    int leaf_of(int index) const {
+        int slot = index >= 0 && index < static_cast<int>(primSlot.size()) ? primSlot[index] : -1;
+        return slot >= 0 ? primLeaf[slot] : -1;
+    }
+    // The primitives as spheres, in the same order as get_prims, or null if
+    // the leaves hold objects
+    const sphereStore* get_sphere_store() const { return sphereLeaves ? &leafSpheres : nullptr; }
+
+private:
+    // Bins per axis when evaluating split candidates
+    static const int BINS = 16;
+    // Below this depth splits fall back to the median to bound the traversal stack
+    static const int MAX_DEPTH = 96;
+    static const int STACK_SIZE = 128;
+    // Relative cost of visiting a node versus intersecting a primitive
+    static constexpr float TRAVERSAL_COST = 1.0f;
+    static constexpr float INTERSECT_COST = 1.0f;
+    static constexpr float REBUILD_RATIO = 1.3f;
+
+    struct buildPrim {
+        aabb box;
+        point3 centroid;
+        int index;
+    };
+
+    // the constructor's list, kept for refits and rebuilds
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<node> nodes;
+    std::vector<int> parents;
+    // per object: position in prims, or -1 if unbounded
+    std::vector<int> primSlot;
+    // per entry of prims: the leaf holding it
+    std::vector<int> primLeaf;
+    // sum of every node's SAH cost term, unnormalized, and its value after the build
+    double sahSum;
+    float builtCost;
+    // objects with a bounding box, in leaf order
+    std::vector<shared_ptr<hittable>> prims;
+    // index into the source objects of each entry of prims
+    std::vector<int> primIndices;
+    // objects without one, tested for every ray
+    std::vector<shared_ptr<hittable>> unbounded;
+    LeafFormat leafFormat;
+    // whether prims are all spheres, copied into leafSpheres, with Spheres leaves
+    bool sphereLeaves;
+    sphereStore leafSpheres;
+    int maxLeafSize;
+    BvhBuilder builder;
+    ThreadPool* pool;
+    AccelStats buildStats;
+
+    void buildAll();
+    // closest hit into rec as intersect leaves it, or with AnyHit the first
+    // one found and no record
+    template <bool AnyHit>
+    bool traverse(const ray& r, float t_min, float t_max, hit_record* rec) const;
+    // in bvhLinear.cpp
+    void buildLinear(std::vector<buildPrim>& work);
+    int build(std::vector<buildPrim>& work, int begin, int end, int depth);
+    double nodeCost(const node& n) const;
+    float currentCost() const;
+    int makeLeaf(std::vector<buildPrim>& work, int begin, int end, const aabb& bounds);
+};
+
+#endif
@@ -0,0 +1,509 @@
+#include "bvh4.h"
+#include "dispatch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH4_SSE 1
+#endif
+
+bvh4::bvh4(const std::vector<shared_ptr<hittable>>& objects, int maxLeafSize, BvhBuilder builder, ThreadPool* pool,
+           bool quantized, LeafFormat leafFormat)
+    : quantized(quantized), binary(objects, maxLeafSize, builder, pool, leafFormat) {
+    collapseAll();
+}
+
+void bvh4::collapseAll() {
+    auto start = std::chrono::steady_clock::now();
+
+    const AccelStats& source = binary.stats();
+    buildStats = AccelStats();
+    buildStats.sahCost = source.sahCost;
+    buildStats.refits = source.refits;
+    buildStats.lastRefitMs = source.lastRefitMs;
+    buildStats.rebuilds = source.rebuilds;
+
+    nodes.clear();
+    quantizedNodes.clear();
+    slotBinary.clear();
+    wideParent.clear();
+    const std::vector<bvh::node>& from = binary.get_nodes();
+    binarySlot.assign(from.size(), -1);
+    if (!from.empty()) {
+        nodes.reserve(from.size() / 2 + 1);
+        collapse(0, -1, 0);
+    }
+    buildStats.nodes = static_cast<int>(nodes.size());
+    buildStats.bytes = nodes.size() * sizeof(node);
+    if (quantized) {
+        quantizeAll();
+        buildStats.bytes = quantizedNodes.size() * sizeof(quantizedNode);
+    }
+    buildStats.bytes += binary.get_prims().size() * sizeof(shared_ptr<hittable>);
+    buildStats.bytes += (slotBinary.size() + wideParent.size() + binarySlot.size()) * sizeof(int);
+
+    double collapseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    buildStats.buildMs = source.buildMs + collapseMs;
+}
+
+// Bounds decode as origin + q * 2^exponent. The product is exact, so the
+// one rounding in the sum happens the same way here and in traversal.
+static float decode(float origin, int q, float step) {
+    return origin + static_cast<float>(q) * step;
+}
+
+void bvh4::quantizeAll() {
+    quantizedNodes.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++)
+        quantize(nodes[i], quantizedNodes[i]);
+
+    // traversal only reads the quantized nodes; refits rebuild a node's
+    // float bounds from the binary tree
+    nodes.clear();
+    nodes.shrink_to_fit();
+}
+
+void bvh4::quantize(const node& n, quantizedNode& q) {
+    q.valid = 0;
+    for (int c = 0; c < WIDTH; c++) {
+        if (n.child[c] >= 0)
+            q.valid |= 1 << c;
+        q.child[c] = n.child[c];
+        q.count[c] = static_cast<uint8_t>(n.count[c]);
+        for (int a = 0; a < 3; a++) {
+            // an empty box, for good measure: unused slots are masked off
+            q.lo[a][c] = 255;
+            q.hi[a][c] = 0;
+        }
+    }
+
+    for (int a = 0; a < 3; a++) {
+        float lo = infinity, hi = -infinity;
+        for (int c = 0; c < WIDTH; c++) {
+            if (q.valid & (1 << c)) {
+                lo = std::min(lo, n.lo[a][c]);
+                hi = std::max(hi, n.hi[a][c]);
+            }
+        }
+        q.origin[a] = lo;
+
+        // the smallest power of two step that spans the node in 255
+        // steps, one larger if rounding leaves a child uncovered
+        int exponent = -126;
+        if (hi > lo)
+            std::frexp((hi - lo) / 255.0f, &exponent);
+        exponent = std::max(exponent, -126);
+        for (;; exponent++) {
+            float step = std::ldexp(1.0f, exponent);
+            bool covered = true;
+            for (int c = 0; c < WIDTH && covered; c++) {
+                if (!(q.valid & (1 << c)))
+                    continue;
+                int qlo = std::max(0, std::min(255, static_cast<int>(std::floor((n.lo[a][c] - lo) / step))));
+                while (qlo > 0 && decode(lo, qlo, step) > n.lo[a][c])
+                    qlo--;
+                int qhi = std::max(0, std::min(255, static_cast<int>(std::ceil((n.hi[a][c] - lo) / step))));
+                while (qhi < 255 && decode(lo, qhi, step) < n.hi[a][c])
+                    qhi++;
+                covered = decode(lo, qlo, step) <= n.lo[a][c] && decode(lo, qhi, step) >= n.hi[a][c];
+                q.lo[a][c] = static_cast<uint8_t>(qlo);
+                q.hi[a][c] = static_cast<uint8_t>(qhi);
+            }
+            if (covered)
+                break;
+        }
+        q.exponent[a] = static_cast<int8_t>(exponent);
+    }
+}
+
+bvh4::node bvh4::unquantized(int index) const {
+    const std::vector<bvh::node>& from = binary.get_nodes();
+    const quantizedNode& q = quantizedNodes[index];
+    node n;
+    for (int c = 0; c < WIDTH; c++) {
+        int b = slotBinary[index * WIDTH + c];
+        for (int a = 0; a < 3; a++) {
+            n.lo[a][c] = b >= 0 ? from[b].lo[a] : infinity;
+            n.hi[a][c] = b >= 0 ? from[b].hi[a] : -infinity;
+        }
+        n.child[c] = q.child[c];
+        n.count[c] = q.count[c];
+    }
+    return n;
+}
+
+bool bvh4::slotEncloses(int slot) const {
+    const bvh::node& from = binary.get_nodes()[slotBinary[slot]];
+    const quantizedNode& q = quantizedNodes[slot / WIDTH];
+    int c = slot % WIDTH;
+    for (int a = 0; a < 3; a++) {
+        float step = std::ldexp(1.0f, q.exponent[a]);
+        if (decode(q.origin[a], q.lo[a][c], step) > from.lo[a] || decode(q.origin[a], q.hi[a][c], step) < from.hi[a])
+            return false;
+    }
+    return true;
+}
+
+static float binaryArea(const bvh::node& n) {
+    float dx = n.hi[0] - n.lo[0], dy = n.hi[1] - n.lo[1], dz = n.hi[2] - n.lo[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+int bvh4::collapse(int binaryIndex, int parentSlot, int depth) {
+    const std::vector<bvh::node>& from = binary.get_nodes();
+    buildStats.maxDepth = std::max(buildStats.maxDepth, depth);
+
+    // Start from the two children and keep opening the largest interior one
+    // until there are four; a leaf root becomes a node with one child
+    int slots[WIDTH];
+    int used = 0;
+    const bvh::node& root = from[binaryIndex];
+    if (root.count > 0) {
+        slots[used++] = binaryIndex;
+    } else {
+        slots[used++] = binaryIndex + 1;
+        slots[used++] = root.offset;
+    }
+    while (used < WIDTH) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int i = 0; i < used; i++) {
+            const bvh::node& n = from[slots[i]];
+            if (n.count == 0 && binaryArea(n) > bestArea) {
+                bestArea = binaryArea(n);
+                best = i;
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = slots[best];
+        slots[best] = opened + 1;
+        slots[used++] = from[opened].offset;
+    }
+
+    int index = static_cast<int>(nodes.size());
+    node wide;
+    for (int c = 0; c < WIDTH; c++) {
+        // an empty box that no ray can enter
+        for (int a = 0; a < 3; a++) {
+            wide.lo[a][c] = infinity;
+            wide.hi[a][c] = -infinity;
+        }
+        wide.child[c] = -1;
+        wide.count[c] = 0;
+    }
+    nodes.push_back(wide);
+    slotBinary.resize(slotBinary.size() + WIDTH, -1);
+    wideParent.push_back(parentSlot);
+
+    for (int c = 0; c < used; c++) {
+        const bvh::node& n = from[slots[c]];
+        int slot = index * WIDTH + c;
+        slotBinary[slot] = slots[c];
+        binarySlot[slots[c]] = slot;
+        for (int a = 0; a < 3; a++) {
+            nodes[index].lo[a][c] = n.lo[a];
+            nodes[index].hi[a][c] = n.hi[a];
+        }
+        if (n.count > 0) {
+            nodes[index].child[c] = n.offset;
+            nodes[index].count[c] = n.count;
+            buildStats.leaves++;
+        } else {
+            int child = collapse(slots[c], slot, depth + 1);
+            nodes[index].child[c] = child;
+        }
+    }
+    return index;
+}
+
+bool bvh4::refit(const std::vector<int>& objectIndices) {
+    auto start = std::chrono::steady_clock::now();
+    bool rebuilt = binary.refit(objectIndices);
+    if (rebuilt) {
+        collapseAll();
+    } else if (quantized) {
+        // Re-encode the node over the leaf, then any ancestor whose decoded
+        // box no longer encloses its child. Boxes are rounded outwards, so a
+        // child can grow without escaping, and one that did not escape says
+        // nothing about its parent: the whole path is checked. Shrinking
+        // only tightens the first node; the rest stay loose but correct.
+        for (int index : objectIndices) {
+            int leaf = binary.leaf_of(index);
+            int slot = leaf >= 0 ? binarySlot[leaf] : -1;
+            for (bool first = true; slot >= 0; first = false) {
+                int wide = slot / WIDTH;
+                if (first || !slotEncloses(slot))
+                    quantize(unquantized(wide), quantizedNodes[wide]);
+                slot = wideParent[wide];
+            }
+        }
+    } else {
+        // A binary leaf always sits in a slot. Walk up the wide nodes from
+        // there; the binary refit stopped where bounds stayed the same, so
+        // the wide one can stop there too.
+        for (int index : objectIndices) {
+            int leaf = binary.leaf_of(index);
+            int slot = leaf >= 0 ? binarySlot[leaf] : -1;
+            while (slot >= 0 && refitSlot(slot))
+                slot = wideParent[slot / WIDTH];
+        }
+    }
+    if (!rebuilt) {
+        const AccelStats& source = binary.stats();
+        buildStats.sahCost = source.sahCost;
+        buildStats.refits = source.refits;
+    }
+    buildStats.lastRefitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return rebuilt;
+}
+
+bool bvh4::refitSlot(int slot) {
+    const bvh::node& from = binary.get_nodes()[slotBinary[slot]];
+    node& n = nodes[slot / WIDTH];
+    int c = slot % WIDTH;
+    bool changed = false;
+    for (int a = 0; a < 3; a++) {
+        changed |= n.lo[a][c] != from.lo[a] || n.hi[a][c] != from.hi[a];
+        n.lo[a][c] = from.lo[a];
+        n.hi[a][c] = from.hi[a];
+    }
+    return changed;
+}
+
+bool bvh4::bounding_box(aabb& output_box) const {
+    return binary.bounding_box(output_box);
+}
+
+namespace {
+
+struct stackEntry {
+    int child;
+    int count;
+    float tNear;
+};
+
+// Slab test of one ray against the four children of a node. Returns a bit
+// per child whose box overlaps [tMin, tMax] and its entry distance in tNear.
+// NaNs from axis-aligned rays resolve the same way as in bvh::hit.
+inline int intersect_children(const bvh4::node& n, const float origin[3], const float invDir[3],
+                              const bool dirNeg[3], float tMin, float tMax, float tNear[4]) {
+#ifdef BVH4_SSE
+    __m128 t0 = _mm_set1_ps(tMin);
+    __m128 t1 = _mm_set1_ps(tMax);
+    for (int a = 0; a < 3; a++) {
+        __m128 o = _mm_set1_ps(origin[a]);
+        __m128 inv = _mm_set1_ps(invDir[a]);
+        __m128 nearPlane = _mm_loadu_ps(dirNeg[a] ? n.hi[a] : n.lo[a]);
+        __m128 farPlane = _mm_loadu_ps(dirNeg[a] ? n.lo[a] : n.hi[a]);
+        // maxps/minps return the second operand when either is NaN
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, o), inv), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, o), inv), t1);
+    }
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+    for (int c = 0; c < bvh4::WIDTH; c++) {
+        float t0 = tMin, t1 = tMax;
+        for (int a = 0; a < 3; a++) {
+            float tn = ((dirNeg[a] ? n.hi[a][c] : n.lo[a][c]) - origin[a]) * invDir[a];
+            float tf = ((dirNeg[a] ? n.lo[a][c] : n.hi[a][c]) - origin[a]) * invDir[a];
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        tNear[c] = t0;
+        if (t0 <= t1)
+            mask |= 1 << c;
+    }
+    return mask;
+#endif
+}
+
+#ifdef BVH4_SSE
+// Four bytes as four floats
+inline __m128 bytes_to_floats(const uint8_t* bytes) {
+    int32_t packed;
+    std::memcpy(&packed, bytes, sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+#endif
+
+// The same test on the decoded bounds of a quantized node
+inline int intersect_children(const bvh4::quantizedNode& n, const float origin[3], const float invDir[3],
+                              const bool dirNeg[3], float tMin, float tMax, float tNear[4]) {
+#ifdef BVH4_SSE
+    __m128 t0 = _mm_set1_ps(tMin);
+    __m128 t1 = _mm_set1_ps(tMax);
+    for (int a = 0; a < 3; a++) {
+        // 2^exponent straight from its bits
+        __m128 step = _mm_castsi128_ps(_mm_set1_epi32((n.exponent[a] + 127) << 23));
+        __m128 base = _mm_set1_ps(n.origin[a]);
+        __m128 lo = _mm_add_ps(base, _mm_mul_ps(bytes_to_floats(n.lo[a]), step));
+        __m128 hi = _mm_add_ps(base, _mm_mul_ps(bytes_to_floats(n.hi[a]), step));
+        __m128 o = _mm_set1_ps(origin[a]);
+        __m128 inv = _mm_set1_ps(invDir[a]);
+        __m128 nearPlane = dirNeg[a] ? hi : lo;
+        __m128 farPlane = dirNeg[a] ? lo : hi;
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, o), inv), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, o), inv), t1);
+    }
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & n.valid;
+#else
+    int mask = 0;
+    for (int c = 0; c < bvh4::WIDTH; c++) {
+        float t0 = tMin, t1 = tMax;
+        for (int a = 0; a < 3; a++) {
+            float step = std::ldexp(1.0f, n.exponent[a]);
+            float lo = decode(n.origin[a], n.lo[a][c], step);
+            float hi = decode(n.origin[a], n.hi[a][c], step);
+            float tn = ((dirNeg[a] ? hi : lo) - origin[a]) * invDir[a];
+            float tf = ((dirNeg[a] ? lo : hi) - origin[a]) * invDir[a];
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        tNear[c] = t0;
+        if (t0 <= t1)
+            mask |= 1 << c;
+    }
+    return mask & n.valid;
+#endif
+}
+
+}
+
+bool bvh4::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (!query<false>(r, t_min, t_max, &rec))
+        return false;
+    complete_record(r, rec);
+    return true;
+}
+
+bool bvh4::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return query<false>(r, t_min, t_max, &rec);
+}
+
+void bvh4::fill_record(const ray& r, hit_record& rec) const {
+    binary.get_sphere_store()->fill_record(rec.prim, r, rec.t, rec);
+}
+
+bool bvh4::occluded(const ray& r, float t_min, float t_max) const {
+    return query<true>(r, t_min, t_max, nullptr);
+}
+
+template <bool AnyHit>
+bool bvh4::query(const ray& r, float t_min, float t_max, hit_record* rec) const {
+    TraversalCounters& counters = traversal_counters();
+    bool closedSet = closed_set_dispatch();
+    counters.rays++;
+
+    bool hit_anything = false;
+    float closest = t_max;
+
+    for (const auto &object : binary.get_unbounded()) {
+        counters.prims++;
+        if (AnyHit) {
+            if (occluded_object(*object, closedSet, r, t_min, closest))
+                return true;
+        } else if (intersect_object(*object, closedSet, r, t_min, closest, *rec)) {
+            hit_anything = true;
+            closest = rec->t;
+        }
+    }
+    if (quantized)
+        return (!quantizedNodes.empty() && traverse<AnyHit>(quantizedNodes.data(), r, t_min, closest, rec))
+            || hit_anything;
+    return (!nodes.empty() && traverse<AnyHit>(nodes.data(), r, t_min, closest, rec)) || hit_anything;
+}
+
+template <bool AnyHit, class Node>
+bool bvh4::traverse(const Node* tree, const ray& r, float t_min, float closest, hit_record* rec) const {
+    TraversalCounters& counters = traversal_counters();
+    bool closedSet = closed_set_dispatch();
+    bool hit_anything = false;
+
+    float origin[3], invDir[3];
+    bool dirNeg[3];
+    for (int a = 0; a < 3; a++) {
+        origin[a] = r.origin()[a];
+        invDir[a] = 1.0f / r.direction()[a];
+        dirNeg[a] = invDir[a] < 0.0f;
+    }
+
+    const std::vector<shared_ptr<hittable>>& prims = binary.get_prims();
+    // leaves index the binary tree's sphere store as they index prims
+    const sphereStore* spheres = binary.get_sphere_store();
+    int sphereHit = -1;
+    stackEntry stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = { 0, 0, t_min };
+
+    while (sp > 0) {
+        stackEntry entry = stack[--sp];
+        // a closer hit was found after this entry was pushed
+        if (entry.tNear > closest)
+            continue;
+
+        if (entry.count > 0 && spheres) {
+            counters.prims += entry.count;
+            int found = spheres->nearest(r, entry.child, entry.child + entry.count, t_min, closest);
+            if (found >= 0) {
+                if (AnyHit)
+                    return true;
+                sphereHit = found;
+            }
+            continue;
+        }
+        if (entry.count > 0) {
+            for (int i = 0; i < entry.count; i++) {
+                counters.prims++;
+                if (AnyHit) {
+                    if (occluded_object(*prims[entry.child + i], closedSet, r, t_min, closest))
+                        return true;
+                } else if (intersect_object(*prims[entry.child + i], closedSet, r, t_min, closest, *rec)) {
+                    hit_anything = true;
+                    closest = rec->t;
+                }
+            }
+            continue;
+        }
+
+        const Node& n = tree[entry.child];
+        counters.nodes++;
+        float tNear[WIDTH];
+        int mask = intersect_children(n, origin, invDir, dirNeg, t_min, closest, tNear);
+        if (mask == 0)
+            continue;
+
+        // sort the hit children far to near so the nearest is popped first
+        stackEntry hits[WIDTH];
+        int hitCount = 0;
+        for (int c = 0; c < WIDTH; c++) {
+            if (!(mask & (1 << c)))
+                continue;
+            stackEntry e = { n.child[c], n.count[c], tNear[c] };
+            int j = hitCount++;
+            while (j > 0 && hits[j - 1].tNear < e.tNear) {
+                hits[j] = hits[j - 1];
+                j--;
+            }
+            hits[j] = e;
+        }
+        for (int i = 0; i < hitCount; i++)
+            stack[sp++] = hits[i];
+    }
+    if (!AnyHit && sphereHit >= 0) {
+        rec->t = closest;
+        rec->object = this;
+        rec->prim = sphereHit;
+        hit_anything = true;
+    }
+    return hit_anything;
+}
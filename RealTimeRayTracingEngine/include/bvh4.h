@@ -0,0 +1,108 @@
+#ifndef BVH4_H
+#define BVH4_H
+
+#include "bvh.h"
+#include "alignedAllocator.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using std::shared_ptr;
+
+// Four-wide BVH made by collapsing the binary SAH tree: each node keeps the
+// bounds of up to four children side by side so one SIMD sequence tests a
+// ray against all of them. Children that are hit are visited nearest first.
+//
+// Built quantized, nodes shrink from 128 to 64 bytes, one cache line, at the
+// price of decoding the bounds on every visit and of slightly looser boxes.
+class bvh4 : public accelStructure
+{
+public:
+    static const int WIDTH = 4;
+
+    struct node {
+        // child bounds, one lane per child: lo[axis][child]
+        float lo[3][WIDTH], hi[3][WIDTH];
+        // interior child: its node index; leaf child: its first primitive;
+        // -1 for an unused slot
+        int32_t child[WIDTH];
+        // primitives in a leaf child, 0 for interior children
+        uint16_t count[WIDTH];
+    };
+
+    // The same node with each child's bounds stored as 8-bit offsets from the
+    // node's lower corner, in steps of a power of two per axis, rounded
+    // outwards so the decoded boxes still enclose the children
+    struct alignas(64) quantizedNode {
+        float origin[3];
+        // the step along each axis is 2^exponent
+        int8_t exponent[3];
+        // a bit per child slot in use
+        uint8_t valid;
+        uint8_t lo[3][WIDTH], hi[3][WIDTH];
+        int32_t child[WIDTH];
+        uint8_t count[WIDTH];
+    };
+
+    explicit bvh4(const std::vector<shared_ptr<hittable>>& objects, int maxLeafSize = 4,
+                  BvhBuilder builder = BvhBuilder::SAH, ThreadPool* pool = nullptr, bool quantized = false,
+                  LeafFormat leafFormat = LeafFormat::Spheres);
+
+    // Refits the underlying binary tree (see bvh::refit) and copies the new
+    // bounds into the child slots along the paths from the moved objects'
+    // leaves, re-encoding the nodes there when quantized, or collapses it
+    // again if it had to be rebuilt. Returns true if it was.
+    virtual bool refit(const std::vector<int>& objectIndices) override;
+    virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual void fill_record(const ray& r, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+    // Packets traverse the binary tree: the wide nodes already spend their
+    // SIMD lanes on the children, while a packet spends them on its rays.
+    virtual void hit_packet(const rayPacket& packet, float t_min, float t_max, hit_record* recs,
+                            bool* hits) const override {
+        binary.hit_packet(packet, t_min, t_max, recs, hits);
+    }
+    virtual bool bounding_box(aabb& output_box) const override;
+
+    virtual const AccelStats& stats() const override { return buildStats; }
+
+private:
+    // A wide node can leave three more entries on the stack than it took off,
+    // and collapsing never makes the tree deeper than the binary one
+    static const int STACK_SIZE = 3 * 128 + 1;
+
+    bool quantized;
+    bvh binary;
+    // one of the two is filled, depending on quantized
+    std::vector<node> nodes;
+    std::vector<quantizedNode, aligned_allocator<quantizedNode, 64>> quantizedNodes;
+    // Bookkeeping for refits. A slot is node * WIDTH + child. Per slot: the
+    // binary node it holds, -1 if unused; per wide node: its slot in its
+    // parent, -1 for the root; per binary node: its slot, -1 for those
+    // opened up by collapsing.
+    std::vector<int> slotBinary;
+    std::vector<int> wideParent;
+    std::vector<int> binarySlot;
+    AccelStats buildStats;
+
+    void collapseAll();
+    int collapse(int binaryIndex, int parentSlot, int depth);
+    // Copies the bounds of the binary node in slot; false if they are unchanged
+    bool refitSlot(int slot);
+    void quantizeAll();
+    static void quantize(const node& n, quantizedNode& q);
+    // The float node behind quantized node index, bounds from the binary tree
+    node unquantized(int index) const;
+    // Whether quantized slot's decoded box still encloses its binary node
+    bool slotEncloses(int slot) const;
+    // closest hit into rec as intersect leaves it, or with AnyHit the first
+    // one found and no record
+    template <bool AnyHit>
+    bool query(const ray& r, float t_min, float t_max, hit_record* rec) const;
+    template <bool AnyHit, class Node>
+    bool traverse(const Node* tree, const ray& r, float t_min, float closest, hit_record* rec) const;
+};
+
+#endif
@@ -0,0 +1,539 @@
+// Linear BVH construction (Karras 2012, "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees") with the optional treelet
+// restructuring of Karras and Aila 2013.
+
+#include "bvh.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+
+namespace {
+
+// Leaves of a treelet the restructuring pass optimizes, and the fewest
+// primitives below a node for it to be worth restructuring
+const int TREELET_LEAVES = 7;
+const int TREELET_MIN_PRIMS = 16;
+// Smallest amount of work worth handing to another thread
+const int MIN_CHUNK = 1024;
+
+// Spreads 10 bits out so that two zero bits follow each of them
+inline uint32_t expand_bits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code of a point in the unit cube
+inline uint32_t morton_code(float x, float y, float z) {
+    auto quantize = [](float f) {
+        return static_cast<uint32_t>(std::min(std::max(f * 1024.0f, 0.0f), 1023.0f));
+    };
+    return (expand_bits(quantize(x)) << 2) | (expand_bits(quantize(y)) << 1) | expand_bits(quantize(z));
+}
+
+inline int count_leading_zeros(uint32_t v) {
+#if defined(__GNUC__)
+    return v ? __builtin_clz(v) : 32;
+#else
+    int n = 0;
+    for (uint32_t bit = 0x80000000u; bit && !(v & bit); bit >>= 1)
+        n++;
+    return n;
+#endif
+}
+
+inline int lowest_bit(int mask) {
+    int k = 0;
+    while (!(mask & (1 << k)))
+        k++;
+    return k;
+}
+
+// Binary radix tree over Morton-sorted primitives. Internal nodes are
+// numbered 0..n-2 with 0 the root; a child reference >= 0 is an internal
+// node and ~i is the leaf holding sorted primitive i. Every phase runs in
+// parallel over the pool; only the top few levels of the final layout are
+// written by the calling thread.
+class linearBuilder {
+public:
+    linearBuilder(ThreadPool* pool, int maxLeafSize, bool treelets, float traversalCost, float intersectCost)
+        : pool(pool), maxLeafSize(maxLeafSize), treelets(treelets),
+          traversalCost(traversalCost), intersectCost(intersectCost), chunks(1), boxes(nullptr) {}
+
+    // Builds over the given primitive bounds (at least one). primOrder
+    // receives, for every primitive slot the leaves refer to, the index into
+    // boxes it stands for.
+    void build(const std::vector<aabb>& boxes, std::vector<bvh::node>& nodes, std::vector<int>& primOrder,
+               int& leaves, int& maxDepth);
+
+private:
+    struct radixNode {
+        aabb box;
+        int left, right, parent;
+        int primCount;
+        // nodes this subtree takes in the final layout, 1 if it becomes a leaf
+        int flatSize;
+        // SAH cost of the subtree, not normalized by any root area
+        float cost;
+    };
+
+    struct emitTask {
+        int ref;
+        int index;
+        int primOffset;
+        int depth;
+    };
+
+    ThreadPool* pool;
+    int maxLeafSize;
+    bool treelets;
+    float traversalCost, intersectCost;
+    int chunks;
+    const std::vector<aabb>* boxes;
+    std::vector<uint32_t> codes;
+    // sorted position -> index into boxes
+    std::vector<int> order;
+    std::vector<radixNode> tree;
+    std::vector<int> leafParent;
+
+    const aabb& boxOf(int ref) const { return ref >= 0 ? tree[ref].box : (*boxes)[order[~ref]]; }
+    int countOf(int ref) const { return ref >= 0 ? tree[ref].primCount : 1; }
+    int flatOf(int ref) const { return ref >= 0 ? tree[ref].flatSize : 1; }
+    float costOf(int ref) const { return ref >= 0 ? tree[ref].cost : intersectCost * boxOf(ref).surface_area(); }
+    void setParent(int ref, int parent) {
+        if (ref >= 0)
+            tree[ref].parent = parent;
+        else
+            leafParent[~ref] = parent;
+    }
+
+    // Runs body(chunk, begin, end) for every chunk of [0, count)
+    void forChunks(int count, const std::function<void(int, int, int)>& body);
+    void sortCodes();
+    int delta(int i, int j) const;
+    void linkNode(int i);
+    void finish(int i);
+    void finishCost(int i);
+    void restructure(int root);
+    float treeletCost(int ref, const int* internals, int internalCount) const;
+    int assign(int mask, const int* leaves, const int* internals, int& next, const aabb* box, const int* split);
+    void emit(const emitTask& task, std::vector<bvh::node>& nodes, std::vector<int>& primOrder,
+              emitTask* children, int& childCount) const;
+};
+
+void linearBuilder::forChunks(int count, const std::function<void(int, int, int)>& body) {
+    int size = (count + chunks - 1) / chunks;
+    auto run = [&](int c) {
+        int begin = c * size;
+        int end = std::min(count, begin + size);
+        if (begin < end)
+            body(c, begin, end);
+    };
+    if (!pool || chunks == 1) {
+        for (int c = 0; c < chunks; c++)
+            run(c);
+    } else {
+        pool->parallelFor(chunks, run);
+    }
+}
+
+// Least significant digit radix sort of the codes, carrying order along.
+// Each chunk counts its digits, a digit-major scan over all counts gives each
+// chunk its output ranges, and each chunk scatters its items in order, so
+// every pass is stable.
+void linearBuilder::sortCodes() {
+    int n = static_cast<int>(codes.size());
+    std::vector<uint32_t> codesOut(n);
+    std::vector<int> orderOut(n);
+    std::vector<int> offsets(chunks * 256);
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        forChunks(n, [&](int c, int begin, int end) {
+            int* histogram = &offsets[c * 256];
+            for (int i = begin; i < end; i++)
+                histogram[(codes[i] >> shift) & 255]++;
+        });
+
+        int sum = 0;
+        for (int d = 0; d < 256; d++) {
+            for (int c = 0; c < chunks; c++) {
+                int count = offsets[c * 256 + d];
+                offsets[c * 256 + d] = sum;
+                sum += count;
+            }
+        }
+
+        forChunks(n, [&](int c, int begin, int end) {
+            int* next = &offsets[c * 256];
+            for (int i = begin; i < end; i++) {
+                int slot = next[(codes[i] >> shift) & 255]++;
+                codesOut[slot] = codes[i];
+                orderOut[slot] = order[i];
+            }
+        });
+        codes.swap(codesOut);
+        order.swap(orderOut);
+    }
+}
+
+// Length of the common prefix of two sorted keys; equal codes are told
+// apart by their positions
+int linearBuilder::delta(int i, int j) const {
+    if (j < 0 || j >= static_cast<int>(codes.size()))
+        return -1;
+    if (codes[i] == codes[j])
+        return 32 + count_leading_zeros(static_cast<uint32_t>(i ^ j));
+    return count_leading_zeros(codes[i] ^ codes[j]);
+}
+
+// Finds the key range internal node i covers and where it splits. Depends
+// on nothing but the sorted codes, so every node is linked independently.
+void linearBuilder::linkNode(int i) {
+    int d = delta(i, i + 1) - delta(i, i - 1) >= 0 ? 1 : -1;
+
+    // upper bound on the range length, then binary search for its other end
+    int minPrefix = delta(i, i - d);
+    int maxLength = 2;
+    while (delta(i, i + maxLength * d) > minPrefix)
+        maxLength *= 2;
+    int length = 0;
+    for (int step = maxLength / 2; step >= 1; step /= 2) {
+        if (delta(i, i + (length + step) * d) > minPrefix)
+            length += step;
+    }
+    int j = i + length * d;
+
+    // the split is where the prefix shared with i gets longer than the range's
+    int nodePrefix = delta(i, j);
+    int split = 0;
+    int step = length;
+    do {
+        step = (step + 1) >> 1;
+        if (split + step < length && delta(i, i + (split + step) * d) > nodePrefix)
+            split += step;
+    } while (step > 1);
+    int gamma = i + split * d + std::min(d, 0);
+
+    int left = std::min(i, j) == gamma ? ~gamma : gamma;
+    int right = std::max(i, j) == gamma + 1 ? ~(gamma + 1) : gamma + 1;
+    tree[i].left = left;
+    tree[i].right = right;
+    setParent(left, i);
+    setParent(right, i);
+}
+
+void linearBuilder::finish(int i) {
+    radixNode& n = tree[i];
+    n.box = surrounding_box(boxOf(n.left), boxOf(n.right));
+    n.primCount = countOf(n.left) + countOf(n.right);
+    if (treelets && n.primCount >= TREELET_MIN_PRIMS)
+        restructure(i);
+    else
+        finishCost(i);
+}
+
+// Same leaf rule as the top-down builder: collapse the subtree into one leaf
+// when that is allowed and no more expensive than keeping it split
+void linearBuilder::finishCost(int i) {
+    radixNode& n = tree[i];
+    float area = n.box.surface_area();
+    float splitCost = traversalCost * area + costOf(n.left) + costOf(n.right);
+    float leafCost = intersectCost * n.primCount * area;
+    if (n.primCount <= maxLeafSize && leafCost <= splitCost) {
+        n.cost = leafCost;
+        n.flatSize = 1;
+    } else {
+        n.cost = splitCost;
+        n.flatSize = 1 + flatOf(n.left) + flatOf(n.right);
+    }
+}
+
+float linearBuilder::treeletCost(int ref, const int* internals, int internalCount) const {
+    if (std::find(internals, internals + internalCount, ref) == internals + internalCount)
+        return costOf(ref);
+    const radixNode& n = tree[ref];
+    return traversalCost * n.box.surface_area() + treeletCost(n.left, internals, internalCount)
+        + treeletCost(n.right, internals, internalCount);
+}
+
+int linearBuilder::assign(int mask, const int* leaves, const int* internals, int& next,
+                          const aabb* box, const int* split) {
+    if ((mask & (mask - 1)) == 0)
+        return leaves[lowest_bit(mask)];
+
+    int i = internals[next++];
+    int left = assign(split[mask], leaves, internals, next, box, split);
+    int right = assign(mask ^ split[mask], leaves, internals, next, box, split);
+    radixNode& n = tree[i];
+    n.left = left;
+    n.right = right;
+    setParent(left, i);
+    setParent(right, i);
+    n.box = box[mask];
+    n.primCount = countOf(left) + countOf(right);
+    finishCost(i);
+    return i;
+}
+
+// Grows a treelet below root by repeatedly opening its largest leaf, then
+// rebuilds its top with the topology of lowest SAH cost over those leaves,
+// found by dynamic programming over every subset of them. The subtrees
+// below the treelet were finished (and restructured) before.
+void linearBuilder::restructure(int root) {
+    int leaves[TREELET_LEAVES];
+    int internals[TREELET_LEAVES - 1];
+    int leafCount = 0, internalCount = 0;
+    internals[internalCount++] = root;
+    leaves[leafCount++] = tree[root].left;
+    leaves[leafCount++] = tree[root].right;
+    while (leafCount < TREELET_LEAVES) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int k = 0; k < leafCount; k++) {
+            if (leaves[k] >= 0 && tree[leaves[k]].box.surface_area() > bestArea) {
+                bestArea = tree[leaves[k]].box.surface_area();
+                best = k;
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = leaves[best];
+        internals[internalCount++] = opened;
+        leaves[best] = tree[opened].left;
+        leaves[leafCount++] = tree[opened].right;
+    }
+
+    // two leaves only have one topology
+    if (leafCount < 3) {
+        finishCost(root);
+        return;
+    }
+
+    int full = (1 << leafCount) - 1;
+    aabb box[1 << TREELET_LEAVES];
+    float cost[1 << TREELET_LEAVES];
+    int split[1 << TREELET_LEAVES];
+    for (int mask = 1; mask <= full; mask++) {
+        int low = mask & -mask;
+        if (mask == low) {
+            box[mask] = boxOf(leaves[lowest_bit(mask)]);
+            cost[mask] = costOf(leaves[lowest_bit(mask)]);
+            continue;
+        }
+        box[mask] = surrounding_box(box[mask ^ low], box[low]);
+
+        // partitions with the lowest leaf on the left, so each is seen once
+        float best = infinity;
+        int bestSplit = low;
+        for (int part = (mask - 1) & mask; part > 0; part = (part - 1) & mask) {
+            if (!(part & low))
+                continue;
+            float c = cost[part] + cost[mask ^ part];
+            if (c < best) {
+                best = c;
+                bestSplit = part;
+            }
+        }
+        cost[mask] = traversalCost * box[mask].surface_area() + best;
+        split[mask] = bestSplit;
+    }
+
+    if (cost[full] >= treeletCost(root, internals, internalCount)) {
+        finishCost(root);
+        return;
+    }
+    int next = 0;
+    assign(full, leaves, internals, next, box, split);
+}
+
+// Writes the node for task.ref at task.index. An interior node puts the
+// child lying lower along the axis that separates them best first, which
+// is the order bvh::hit assumes, and hands back a task for each child.
+void linearBuilder::emit(const emitTask& task, std::vector<bvh::node>& nodes, std::vector<int>& primOrder,
+                         emitTask* children, int& childCount) const {
+    bvh::node& out = nodes[task.index];
+    const aabb& bounds = boxOf(task.ref);
+    for (int a = 0; a < 3; a++) {
+        out.lo[a] = bounds.minimum[a];
+        out.hi[a] = bounds.maximum[a];
+    }
+
+    if (flatOf(task.ref) == 1) {
+        out.offset = task.primOffset;
+        out.count = static_cast<uint16_t>(countOf(task.ref));
+        out.axis = 0;
+        childCount = 0;
+
+        // the leaf's primitives, from anywhere in the subtree it replaces
+        int stack[2 * 256];
+        int sp = 0;
+        int slot = task.primOffset;
+        stack[sp++] = task.ref;
+        while (sp > 0) {
+            int ref = stack[--sp];
+            if (ref < 0) {
+                primOrder[slot++] = order[~ref];
+            } else {
+                stack[sp++] = tree[ref].right;
+                stack[sp++] = tree[ref].left;
+            }
+        }
+        return;
+    }
+
+    const radixNode& n = tree[task.ref];
+    point3 leftCenter = boxOf(n.left).centroid();
+    point3 rightCenter = boxOf(n.right).centroid();
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (std::abs(rightCenter[a] - leftCenter[a]) > std::abs(rightCenter[axis] - leftCenter[axis]))
+            axis = a;
+    }
+    int first = n.left, second = n.right;
+    if (rightCenter[axis] < leftCenter[axis])
+        std::swap(first, second);
+
+    out.count = 0;
+    out.axis = static_cast<uint16_t>(axis);
+    out.offset = task.index + 1 + flatOf(first);
+    children[0] = { first, task.index + 1, task.primOffset, task.depth + 1 };
+    children[1] = { second, out.offset, task.primOffset + countOf(first), task.depth + 1 };
+    childCount = 2;
+}
+
+void linearBuilder::build(const std::vector<aabb>& boxes, std::vector<bvh::node>& nodes,
+                          std::vector<int>& primOrder, int& leaves, int& maxDepth) {
+    this->boxes = &boxes;
+    int n = static_cast<int>(boxes.size());
+    chunks = pool ? std::max(1, std::min(pool->size() * 4, n / MIN_CHUNK)) : 1;
+
+    // Morton codes of the centroids, within the bounds of all centroids
+    std::vector<aabb> chunkBounds(chunks);
+    forChunks(n, [&](int c, int begin, int end) {
+        for (int i = begin; i < end; i++)
+            chunkBounds[c].grow(boxes[i].centroid());
+    });
+    aabb centroidBounds;
+    for (const aabb& b : chunkBounds)
+        centroidBounds.grow(b);
+    vec3 extent = centroidBounds.maximum - centroidBounds.minimum;
+    vec3 scale;
+    for (int a = 0; a < 3; a++)
+        scale[a] = extent[a] > 0.0f ? 1.0f / extent[a] : 0.0f;
+
+    codes.resize(n);
+    order.resize(n);
+    forChunks(n, [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            vec3 p = boxes[i].centroid() - centroidBounds.minimum;
+            codes[i] = morton_code(p.x() * scale.x(), p.y() * scale.y(), p.z() * scale.z());
+            order[i] = i;
+        }
+    });
+    sortCodes();
+
+    tree.assign(std::max(n - 1, 0), radixNode());
+    leafParent.assign(n, -1);
+    if (n > 1) {
+        tree[0].parent = -1;
+        std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[n - 1]);
+        forChunks(n - 1, [&](int, int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                visits[i].store(0, std::memory_order_relaxed);
+                linkNode(i);
+            }
+        });
+
+        // Bounds and costs bottom-up: of the two threads arriving at a node
+        // from its children, the second one finishes it and walks on
+        forChunks(n, [&](int, int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                int current = leafParent[i];
+                while (current >= 0) {
+                    if (visits[current].fetch_add(1, std::memory_order_acq_rel) == 0)
+                        break;
+                    finish(current);
+                    current = tree[current].parent;
+                }
+            }
+        });
+    }
+
+    // Lay the tree out depth-first. The calling thread writes the top nodes
+    // until there are enough subtrees for everyone, the pool the rest.
+    int root = n > 1 ? 0 : ~0;
+    nodes.resize(flatOf(root));
+    primOrder.resize(n);
+    std::vector<emitTask> frontier(1, emitTask{ root, 0, 0, 0 });
+    int target = pool ? pool->size() * 8 : 1;
+    while (static_cast<int>(frontier.size()) < target) {
+        int best = -1;
+        for (size_t k = 0; k < frontier.size(); k++) {
+            int ref = frontier[k].ref;
+            if (flatOf(ref) > 1 && (best < 0 || countOf(ref) > countOf(frontier[best].ref)))
+                best = static_cast<int>(k);
+        }
+        if (best < 0 || countOf(frontier[best].ref) < MIN_CHUNK)
+            break;
+        emitTask children[2];
+        int childCount;
+        emit(frontier[best], nodes, primOrder, children, childCount);
+        frontier[best] = children[0];
+        frontier.push_back(children[1]);
+    }
+
+    int tasks = static_cast<int>(frontier.size());
+    std::vector<int> taskLeaves(tasks, 0), taskDepth(tasks, 0);
+    auto emitSubtree = [&](int t) {
+        std::vector<emitTask> stack(1, frontier[t]);
+        while (!stack.empty()) {
+            emitTask task = stack.back();
+            stack.pop_back();
+            emitTask children[2];
+            int childCount;
+            emit(task, nodes, primOrder, children, childCount);
+            if (childCount == 0) {
+                taskLeaves[t]++;
+                taskDepth[t] = std::max(taskDepth[t], task.depth);
+            }
+            for (int c = childCount - 1; c >= 0; c--)
+                stack.push_back(children[c]);
+        }
+    };
+    if (!pool || tasks == 1) {
+        for (int t = 0; t < tasks; t++)
+            emitSubtree(t);
+    } else {
+        pool->parallelFor(tasks, emitSubtree);
+    }
+
+    leaves = 0;
+    maxDepth = 0;
+    for (int t = 0; t < tasks; t++) {
+        leaves += taskLeaves[t];
+        maxDepth = std::max(maxDepth, taskDepth[t]);
+    }
+}
+
+}
+
+void bvh::buildLinear(std::vector<buildPrim>& work) {
+    std::vector<aabb> boxes(work.size());
+    for (size_t i = 0; i < work.size(); i++)
+        boxes[i] = work[i].box;
+
+    linearBuilder linear(pool, maxLeafSize, builder == BvhBuilder::LBVHTreelet, TRAVERSAL_COST, INTERSECT_COST);
+    std::vector<int> order;
+    linear.build(boxes, nodes, order, buildStats.leaves, buildStats.maxDepth);
+
+    primIndices.resize(order.size());
+    for (size_t i = 0; i < order.size(); i++)
+        primIndices[i] = work[order[i]].index;
+}
@@ -0,0 +1,251 @@
+// Packet traversal of the binary BVH (Wald, Slusallek, Benthin and Wagner
+// 2001, "Interactive Rendering with Coherent Ray Tracing") with the interval
+// arithmetic frustum test of Reshetov, Soupikov and Hurley 2005.
+
+#include "bvh.h"
+#include "dispatch.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_PACKET_SSE 1
+#endif
+
+namespace {
+
+const int LANES = rayPacket::SIZE;
+
+// The packet as traversal needs it. Lanes past the packet's count repeat
+// the first ray and have a closest hit of -infinity, so they never hit.
+struct packetState {
+    alignas(16) float origin[3][LANES];
+    alignas(16) float invDir[3][LANES];
+    alignas(16) float closest[LANES];
+    // per axis, shared by every ray
+    bool dirNeg[3];
+    // Bounds of the origins and inverse directions over the packet, the
+    // corners of the frustum test. Unset when a direction has a zero
+    // component, whose infinite inverse would make the products NaN.
+    bool frustum;
+    float originMin[3], originMax[3];
+    float invMin[3], invMax[3];
+};
+
+// Slab test of the rays in mask against one box, the same arithmetic as
+// bvh::hit. Returns the rays that overlap it between t_min and their closest hit.
+inline int intersect_lanes(const bvh::node& n, const packetState& p, int mask, float t_min) {
+    int result = 0;
+#ifdef BVH_PACKET_SSE
+    for (int g = 0; g < LANES; g += 4) {
+        if (!((mask >> g) & 0xF))
+            continue;
+        __m128 t0 = _mm_set1_ps(t_min);
+        __m128 t1 = _mm_load_ps(p.closest + g);
+        for (int a = 0; a < 3; a++) {
+            __m128 o = _mm_load_ps(p.origin[a] + g);
+            __m128 inv = _mm_load_ps(p.invDir[a] + g);
+            __m128 nearPlane = _mm_set1_ps(p.dirNeg[a] ? n.hi[a] : n.lo[a]);
+            __m128 farPlane = _mm_set1_ps(p.dirNeg[a] ? n.lo[a] : n.hi[a]);
+            // maxps/minps return the second operand when either is NaN
+            t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, o), inv), t0);
+            t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, o), inv), t1);
+        }
+        result |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << g;
+    }
+#else
+    for (int i = 0; i < LANES; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        float t0 = t_min, t1 = p.closest[i];
+        for (int a = 0; a < 3; a++) {
+            float tNear = ((p.dirNeg[a] ? n.hi[a] : n.lo[a]) - p.origin[a][i]) * p.invDir[a][i];
+            float tFar = ((p.dirNeg[a] ? n.lo[a] : n.hi[a]) - p.origin[a][i]) * p.invDir[a][i];
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar < t1 ? tFar : t1;
+        }
+        if (t0 <= t1)
+            result |= 1 << i;
+    }
+#endif
+    return result & mask;
+}
+
+// Whether the box certainly misses every ray of the packet. Each ray's entry
+// and exit distances lie between the extremes of the slab products over the
+// corners of the origin and inverse direction ranges; rounding is monotonic,
+// so that also holds for the computed values.
+inline bool frustum_misses(const bvh::node& n, const packetState& p, float t_min, float t_max) {
+    float enter = t_min, exit = t_max;
+    for (int a = 0; a < 3; a++) {
+        float nearPlane = p.dirNeg[a] ? n.hi[a] : n.lo[a];
+        float farPlane = p.dirNeg[a] ? n.lo[a] : n.hi[a];
+        float n0 = nearPlane - p.originMax[a], n1 = nearPlane - p.originMin[a];
+        float f0 = farPlane - p.originMax[a], f1 = farPlane - p.originMin[a];
+        float nearMin = std::min(std::min(n0 * p.invMin[a], n0 * p.invMax[a]),
+                                 std::min(n1 * p.invMin[a], n1 * p.invMax[a]));
+        float farMax = std::max(std::max(f0 * p.invMin[a], f0 * p.invMax[a]),
+                                std::max(f1 * p.invMin[a], f1 * p.invMax[a]));
+        enter = std::max(enter, nearMin);
+        exit = std::min(exit, farMax);
+    }
+    return enter > exit;
+}
+
+struct packetEntry {
+    int node;
+    int mask;
+};
+
+}
+
+void bvh::hit_packet(const rayPacket& packet, float t_min, float t_max, hit_record* recs, bool* hits) const {
+    int count = packet.count;
+    if (count == 0)
+        return;
+
+    packetState p;
+    for (int i = 0; i < LANES; i++) {
+        int lane = i < count ? i : 0;
+        p.origin[0][i] = packet.ox[lane];
+        p.origin[1][i] = packet.oy[lane];
+        p.origin[2][i] = packet.oz[lane];
+        p.invDir[0][i] = 1.0f / packet.dx[lane];
+        p.invDir[1][i] = 1.0f / packet.dy[lane];
+        p.invDir[2][i] = 1.0f / packet.dz[lane];
+        p.closest[i] = i < count ? t_max : -infinity;
+    }
+
+    // Sharing the near-first order needs the rays to agree on the direction
+    // signs; camera rays only disagree in blocks straddling an axis.
+    bool coherent = true;
+    p.frustum = true;
+    for (int a = 0; a < 3; a++) {
+        p.dirNeg[a] = p.invDir[a][0] < 0.0f;
+        p.originMin[a] = p.originMax[a] = p.origin[a][0];
+        p.invMin[a] = p.invMax[a] = p.invDir[a][0];
+        for (int i = 0; i < count; i++) {
+            coherent &= (p.invDir[a][i] < 0.0f) == p.dirNeg[a];
+            p.frustum &= std::isfinite(p.invDir[a][i]);
+            p.originMin[a] = std::min(p.originMin[a], p.origin[a][i]);
+            p.originMax[a] = std::max(p.originMax[a], p.origin[a][i]);
+            p.invMin[a] = std::min(p.invMin[a], p.invDir[a][i]);
+            p.invMax[a] = std::max(p.invMax[a], p.invDir[a][i]);
+        }
+    }
+    if (!coherent) {
+        for (int i = 0; i < count; i++)
+            hits[i] = hit(packet.get(i), t_min, t_max, recs[i]);
+        return;
+    }
+
+    TraversalCounters& counters = traversal_counters();
+    bool closedSet = closed_set_dispatch();
+    counters.rays += count;
+
+    ray rays[LANES];
+    for (int i = 0; i < count; i++) {
+        rays[i] = packet.get(i);
+        hits[i] = false;
+    }
+
+    // farthest closest hit of any ray, the far end of the frustum
+    float farthest = t_max;
+    auto update_farthest = [&]() {
+        farthest = p.closest[0];
+        for (int i = 1; i < count; i++)
+            farthest = std::max(farthest, p.closest[i]);
+    };
+
+    for (const auto &object : unbounded) {
+        for (int i = 0; i < count; i++) {
+            counters.prims++;
+            if (intersect_object(*object, closedSet, rays[i], t_min, p.closest[i], recs[i])) {
+                hits[i] = true;
+                p.closest[i] = recs[i].t;
+            }
+        }
+    }
+    if (nodes.empty())
+        return;
+    update_farthest();
+
+    // with sphere leaves only each ray's final hit goes into its record
+    int sphereHit[LANES];
+    for (int i = 0; i < count; i++)
+        sphereHit[i] = -1;
+
+    packetEntry stack[STACK_SIZE];
+    int sp = 0;
+    packetEntry current = { 0, (1 << count) - 1 };
+    while (true) {
+        const node& n = nodes[current.node];
+        counters.nodes++;
+
+        int mask = 0;
+        if (!p.frustum || !frustum_misses(n, p, t_min, farthest))
+            mask = intersect_lanes(n, p, current.mask, t_min);
+
+        if (mask) {
+            if (n.count > 0 && sphereLeaves) {
+                bool closer = false;
+                for (int i = 0; i < count; i++) {
+                    if (!(mask & (1 << i)))
+                        continue;
+                    counters.prims += n.count;
+                    int found = leafSpheres.nearest(rays[i], n.offset, n.offset + n.count, t_min, p.closest[i]);
+                    if (found >= 0) {
+                        sphereHit[i] = found;
+                        closer = true;
+                    }
+                }
+                if (closer)
+                    update_farthest();
+            } else if (n.count > 0) {
+                bool closer = false;
+                for (int k = 0; k < n.count; k++) {
+                    const hittable& prim = *prims[n.offset + k];
+                    for (int i = 0; i < count; i++) {
+                        if (!(mask & (1 << i)))
+                            continue;
+                        counters.prims++;
+                        if (intersect_object(prim, closedSet, rays[i], t_min, p.closest[i], recs[i])) {
+                            hits[i] = true;
+                            p.closest[i] = recs[i].t;
+                            closer = true;
+                        }
+                    }
+                }
+                if (closer)
+                    update_farthest();
+            } else {
+                // the rays agree on which child is on the near side
+                if (p.dirNeg[n.axis]) {
+                    stack[sp++] = { current.node + 1, mask };
+                    current = { n.offset, mask };
+                } else {
+                    stack[sp++] = { n.offset, mask };
+                    current = { current.node + 1, mask };
+                }
+                continue;
+            }
+        }
+
+        if (sp == 0)
+            break;
+        current = stack[--sp];
+    }
+
+    // each ray's shading data is worked out once, for its final hit
+    for (int i = 0; i < count; i++) {
+        if (sphereHit[i] >= 0) {
+            recs[i].t = p.closest[i];
+            recs[i].object = this;
+            recs[i].prim = sphereHit[i];
+            hits[i] = true;
+        }
+        if (hits[i])
+            complete_record(rays[i], recs[i]);
+    }
+}
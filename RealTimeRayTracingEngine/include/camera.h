@@ -36,6 +36,13 @@ public:
     vec3 get_lower_left_corner() const { return lower_left_corner; }
     vec3 get_horizontal() const { return horizontal; }
     vec3 get_vertical() const { return vertical; }
+
+    bool operator==(const Camera& other) const {
+        return origin == other.origin && lower_left_corner == other.lower_left_corner
+            && horizontal == other.horizontal && vertical == other.vertical;
+    }
+    bool operator!=(const Camera& other) const { return !(*this == other); }
+
     // Function to get ray from camera to viewport
     ray get_ray(float s, float t) const {
         return ray(origin, lower_left_corner + s*horizontal + t*vertical - origin);
@@ -0,0 +1,68 @@
+#include "cpuFeatures.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_FEATURES_GNU 1
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define CPU_FEATURES_MSVC 1
+#endif
+
+namespace {
+
+SimdLevel detect() {
+#if defined(CPU_FEATURES_GNU)
+    // the builtins also check that the OS saves the AVX and AVX-512 state
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return SimdLevel::SSE42;
+    if (__builtin_cpu_supports("sse2"))
+        return SimdLevel::SSE2;
+    return SimdLevel::Scalar;
+#elif defined(CPU_FEATURES_MSVC)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool sse42 = (info[2] & (1 << 20)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!sse2)
+        return SimdLevel::Scalar;
+    if (!sse42)
+        return SimdLevel::SSE2;
+    // the OS must save the YMM registers, and for AVX-512 the opmask and ZMM ones
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    if (maxLeaf < 7 || (xcr0 & 0x6) != 0x6)
+        return SimdLevel::SSE42;
+    __cpuidex(info, 7, 0);
+    if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+        return SimdLevel::AVX512;
+    if (info[1] & (1 << 5))
+        return SimdLevel::AVX2;
+    return SimdLevel::SSE42;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+}
+
+SimdLevel cpu_simd_level() {
+    static const SimdLevel level = detect();
+    return level;
+}
+
+const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::Scalar: return "scalar";
+    case SimdLevel::SSE2: return "sse2";
+    case SimdLevel::SSE42: return "sse4.2";
+    case SimdLevel::AVX2: return "avx2";
+    case SimdLevel::AVX512: return "avx512";
+    }
+    return "?";
+}
@@ -0,0 +1,33 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+// Instruction sets kernels are built for, narrowest first. SSE2 is the
+// baseline of every x86-64 CPU; the others are taken only if cpuid reports
+// them and the OS saves their registers.
+enum class SimdLevel {
+    // not x86, or a 32-bit build without SSE2
+    Scalar,
+    SSE2,
+    SSE42,
+    AVX2,
+    // AVX-512 Foundation
+    AVX512
+};
+
+// Widest level the CPU running this supports, detected once
+SimdLevel cpu_simd_level();
+const char* simd_level_name(SimdLevel level);
+
+// Each kernel in its own translation unit: code built for a wider level
+// than the baseline must not be inlined into, or shared with, code that
+// runs before the level has been checked. Types used on both sides, such
+// as the vec3xN types, are forced inline for the same reason.
+#if defined(_MSC_VER)
+#define SIMD_INLINE __forceinline
+#elif defined(__GNUC__)
+#define SIMD_INLINE inline __attribute__((always_inline))
+#else
+#define SIMD_INLINE inline
+#endif
+
+#endif
@@ -0,0 +1,3 @@
+#include "dispatch.h"
+
+std::atomic<bool> closedSetDispatch(true);
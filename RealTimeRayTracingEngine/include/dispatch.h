@@ -0,0 +1,77 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "sphere.h"
+#include "material.h"
+
+#include <atomic>
+
+// How traversal and shading call into objects and materials
+enum class Dispatch {
+    // a virtual call for every object tested and every hit shaded
+    Virtual,
+    // The built-in sphere, lambertian, metal and dielectric are told apart
+    // by their tag and called directly, so their code is inlined into the
+    // loops. Other types still go through the virtual call. Classes derived
+    // from the built-in ones keep their base's tag and would be called as
+    // the base, so derive from hittable or material instead.
+    //
+    // It is not a measured win. Virtual calls that nearly always reach the
+    // same sphere and lambertian are well predicted, and the sphere test
+    // dominates either way. In the benchmark's dispatch section the two
+    // modes are within noise on lists, and closed set has measured slower
+    // on BVH scenes: 2.83 against 3.20 Mrays/s on 100k spheres in one run.
+    ClosedSet
+};
+
+// The mode in effect, closed set by default; see Dispatch::ClosedSet for
+// what that costs
+extern std::atomic<bool> closedSetDispatch;
+
+// Applies to every renderer and acceleration structure; change it between
+// frames only
+inline void set_dispatch(Dispatch mode) {
+    closedSetDispatch.store(mode == Dispatch::ClosedSet, std::memory_order_relaxed);
+}
+
+inline Dispatch get_dispatch() {
+    return closedSetDispatch.load(std::memory_order_relaxed) ? Dispatch::ClosedSet : Dispatch::Virtual;
+}
+
+// Whether to take the direct calls. Loops read it once and pass it to the
+// functions below.
+inline bool closed_set_dispatch() {
+    return closedSetDispatch.load(std::memory_order_relaxed);
+}
+
+inline bool intersect_object(const hittable& object, bool closedSet, const ray& r, float t_min, float t_max,
+                             hit_record& rec) {
+    if (closedSet && object.kind() == HittableKind::Sphere)
+        return static_cast<const sphere&>(object).sphere::intersect(r, t_min, t_max, rec);
+    return object.intersect(r, t_min, t_max, rec);
+}
+
+inline bool occluded_object(const hittable& object, bool closedSet, const ray& r, float t_min, float t_max) {
+    if (closedSet && object.kind() == HittableKind::Sphere)
+        return static_cast<const sphere&>(object).sphere::occluded(r, t_min, t_max);
+    return object.occluded(r, t_min, t_max);
+}
+
+inline bool scatter_material(const material& mat, bool closedSet, const ray& r_in, const hit_record& rec,
+                             color& attenuation, ray& scattered, pcg32& rng) {
+    if (closedSet) {
+        switch (mat.type()) {
+        case MaterialType::Lambertian:
+            return static_cast<const lambertian&>(mat).lambertian::scatter(r_in, rec, attenuation, scattered, rng);
+        case MaterialType::Metal:
+            return static_cast<const metal&>(mat).metal::scatter(r_in, rec, attenuation, scattered, rng);
+        case MaterialType::Dielectric:
+            return static_cast<const dielectric&>(mat).dielectric::scatter(r_in, rec, attenuation, scattered, rng);
+        case MaterialType::Other:
+            break;
+        }
+    }
+    return mat.scatter(r_in, rec, attenuation, scattered, rng);
+}
+
+#endif
@@ -0,0 +1,322 @@
+#include "grid.h"
+#include "dispatch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <unordered_map>
+
+namespace {
+
+// Per-thread record of the objects the current ray was already tested
+// against, so one listed in several cells is intersected only once:
+// object i was tested if stamps[i] == ray.
+struct mailbox {
+    uint32_t ray = 0;
+    std::vector<uint32_t> stamps;
+};
+
+// Rebuilt grids leave their mailboxes behind; past this many they are all
+// dropped
+const size_t MAX_MAILBOXES = 16;
+
+// One mailbox per grid build, so a grid reached from inside another, say
+// through an instance, leaves the outer one's stamps alone, and grids taking
+// turns keep theirs. Map entries do not move, so a traversal can hold on to
+// its mailbox while nested ones add theirs.
+struct threadMailboxes {
+    std::unordered_map<uint32_t, mailbox> byBuild;
+    // the last one looked up, which saves hashing when a single grid is traced
+    uint32_t lastBuild = 0;
+    mailbox* last = nullptr;
+    // grid traversals in progress on this thread
+    int depth = 0;
+
+    mailbox& get(uint32_t buildId) {
+        if (last && lastBuild == buildId)
+            return *last;
+        // only between rays, when no traversal holds on to one
+        if (depth == 0 && byBuild.size() > MAX_MAILBOXES)
+            byBuild.clear();
+        lastBuild = buildId;
+        last = &byBuild[buildId];
+        return *last;
+    }
+};
+
+threadMailboxes& thread_mailboxes() {
+    static thread_local threadMailboxes boxes;
+    return boxes;
+}
+
+// Marks a traversal in progress for as long as it is in scope
+struct mailboxUse {
+    threadMailboxes& boxes;
+    explicit mailboxUse(threadMailboxes& boxes) : boxes(boxes) { boxes.depth++; }
+    ~mailboxUse() { boxes.depth--; }
+};
+
+std::atomic<uint32_t> nextBuildId(1);
+
+}
+
+// passed to std::min by reference, so it needs a definition
+const int grid::MAX_RESOLUTION;
+
+grid::grid(const std::vector<shared_ptr<hittable>>& objects) : objects(objects), buildId(0) {
+    buildAll();
+}
+
+void grid::buildAll() {
+    auto start = std::chrono::steady_clock::now();
+
+    unculled.clear();
+    cellStart.clear();
+    cellObjects.clear();
+    bounds = aabb();
+    buildId = nextBuildId++;
+    int refits = buildStats.refits;
+    buildStats = AccelStats();
+    buildStats.refits = refits;
+
+    std::vector<aabb> boxes(objects.size());
+    std::vector<int> candidates;
+    std::vector<float> extents;
+    candidates.reserve(objects.size());
+    extents.reserve(objects.size());
+    for (size_t i = 0; i < objects.size(); i++) {
+        objects[i]->clear_dirty();
+        if (!objects[i]->bounding_box(boxes[i])) {
+            unculled.push_back(objects[i]);
+            continue;
+        }
+        vec3 d = boxes[i].maximum - boxes[i].minimum;
+        candidates.push_back(static_cast<int>(i));
+        extents.push_back(std::max(d.x(), std::max(d.y(), d.z())));
+    }
+
+    float median = 0.0f;
+    if (!extents.empty()) {
+        std::vector<float> sorted = extents;
+        std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+        median = sorted[sorted.size() / 2];
+    }
+
+    std::vector<int> gridded;
+    gridded.reserve(candidates.size());
+    for (size_t k = 0; k < candidates.size(); k++) {
+        int i = candidates[k];
+        if (median > 0.0f && extents[k] > LARGE_OBJECT_RATIO * median) {
+            unculled.push_back(objects[i]);
+        } else {
+            gridded.push_back(i);
+            bounds.grow(boxes[i]);
+        }
+    }
+
+    if (!gridded.empty()) {
+        // Cells about cubic, CELLS_PER_OBJECT of them per object. Flat
+        // dimensions get a sliver of thickness so the volume is not zero.
+        vec3 extent = bounds.maximum - bounds.minimum;
+        float maxExtent = std::max(extent.x(), std::max(extent.y(), extent.z()));
+        float minExtent = std::max(maxExtent * 1e-3f, 1e-6f);
+        for (int a = 0; a < 3; a++)
+            extent[a] = std::max(extent[a], minExtent);
+        bounds.maximum = bounds.minimum + extent;
+
+        float volume = extent.x() * extent.y() * extent.z();
+        float cellsPerUnit = std::cbrt(CELLS_PER_OBJECT * gridded.size() / volume);
+        for (int a = 0; a < 3; a++) {
+            resolution[a] = std::max(1, std::min(MAX_RESOLUTION, static_cast<int>(extent[a] * cellsPerUnit)));
+            cellSize[a] = extent[a] / resolution[a];
+            invCellSize[a] = resolution[a] / extent[a];
+        }
+
+        // count the cells each object overlaps, then list it in each of them
+        int cells = resolution[0] * resolution[1] * resolution[2];
+        cellStart.assign(cells + 1, 0);
+        for (int pass = 0; pass < 2; pass++) {
+            std::vector<int> fill;
+            if (pass == 1) {
+                std::partial_sum(cellStart.begin(), cellStart.end(), cellStart.begin());
+                cellObjects.resize(cellStart[cells]);
+                fill.assign(cellStart.begin(), cellStart.end() - 1);
+            }
+            for (int i : gridded) {
+                int lo[3], hi[3];
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = cellCoord(boxes[i].minimum[a], a);
+                    hi[a] = cellCoord(boxes[i].maximum[a], a);
+                }
+                for (int z = lo[2]; z <= hi[2]; z++)
+                    for (int y = lo[1]; y <= hi[1]; y++)
+                        for (int x = lo[0]; x <= hi[0]; x++) {
+                            int c = cellIndex(x, y, z);
+                            if (pass == 0)
+                                cellStart[c + 1]++;
+                            else
+                                cellObjects[fill[c]++] = i;
+                        }
+            }
+        }
+
+        buildStats.nodes = cells;
+        for (int c = 0; c < cells; c++)
+            buildStats.leaves += cellStart[c + 1] > cellStart[c];
+    }
+
+    buildStats.bytes = (cellStart.size() + cellObjects.size()) * sizeof(int)
+        + objects.size() * sizeof(shared_ptr<hittable>);
+    buildStats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int grid::cellCoord(float p, int axis) const {
+    int c = static_cast<int>((p - bounds.minimum[axis]) * invCellSize[axis]);
+    return std::max(0, std::min(resolution[axis] - 1, c));
+}
+
+// every object may have moved into other cells, so the grid is rebuilt
+bool grid::refit(const std::vector<int>&) {
+    auto start = std::chrono::steady_clock::now();
+    buildAll();
+    buildStats.refits++;
+    buildStats.lastRefitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+bool grid::bounding_box(aabb& output_box) const {
+    aabb box = bounds;
+    for (const auto &object : unculled) {
+        aabb objectBox;
+        if (!object->bounding_box(objectBox))
+            return false;
+        box.grow(objectBox);
+    }
+    if (box.empty())
+        return false;
+    output_box = box;
+    return true;
+}
+
+bool grid::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (!traverse<false>(r, t_min, t_max, &rec))
+        return false;
+    complete_record(r, rec);
+    return true;
+}
+
+bool grid::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return traverse<false>(r, t_min, t_max, &rec);
+}
+
+bool grid::occluded(const ray& r, float t_min, float t_max) const {
+    return traverse<true>(r, t_min, t_max, nullptr);
+}
+
+template <bool AnyHit>
+bool grid::traverse(const ray& r, float t_min, float t_max, hit_record* rec) const {
+    TraversalCounters& counters = traversal_counters();
+    bool closedSet = closed_set_dispatch();
+    counters.rays++;
+
+    bool hit_anything = false;
+    float closest = t_max;
+
+    for (const auto &object : unculled) {
+        counters.prims++;
+        if (AnyHit) {
+            if (occluded_object(*object, closedSet, r, t_min, closest))
+                return true;
+        } else if (intersect_object(*object, closedSet, r, t_min, closest, *rec)) {
+            hit_anything = true;
+            closest = rec->t;
+        }
+    }
+    if (cellStart.empty())
+        return hit_anything;
+
+    // clip the ray to the grid
+    const point3& origin = r.origin();
+    const vec3& dir = r.direction();
+    float t0 = t_min, t1 = closest;
+    for (int a = 0; a < 3; a++) {
+        float invD = 1.0f / dir[a];
+        float tNear = (bounds.minimum[a] - origin[a]) * invD;
+        float tFar = (bounds.maximum[a] - origin[a]) * invD;
+        if (invD < 0.0f)
+            std::swap(tNear, tFar);
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar < t1 ? tFar : t1;
+    }
+    if (t0 > t1)
+        return hit_anything;
+
+    // 3D-DDA setup: the cell the ray enters in, and per axis the distance
+    // to the next cell boundary and between two boundaries
+    point3 entry = r.at(t0);
+    int cell[3], step[3], end[3];
+    float tNext[3], tDelta[3];
+    for (int a = 0; a < 3; a++) {
+        cell[a] = cellCoord(entry[a], a);
+        if (dir[a] > 0.0f) {
+            step[a] = 1;
+            end[a] = resolution[a];
+            tNext[a] = (bounds.minimum[a] + (cell[a] + 1) * cellSize[a] - origin[a]) / dir[a];
+            tDelta[a] = cellSize[a] / dir[a];
+        } else if (dir[a] < 0.0f) {
+            step[a] = -1;
+            end[a] = -1;
+            tNext[a] = (bounds.minimum[a] + cell[a] * cellSize[a] - origin[a]) / dir[a];
+            tDelta[a] = -cellSize[a] / dir[a];
+        } else {
+            step[a] = 0;
+            end[a] = -1;
+            tNext[a] = infinity;
+            tDelta[a] = infinity;
+        }
+    }
+
+    threadMailboxes& boxes = thread_mailboxes();
+    mailbox& box = boxes.get(buildId);
+    mailboxUse use(boxes);
+    if (box.stamps.size() != objects.size()) {
+        box.stamps.assign(objects.size(), 0);
+        box.ray = 0;
+    }
+    if (++box.ray == 0) {
+        std::fill(box.stamps.begin(), box.stamps.end(), 0);
+        box.ray = 1;
+    }
+
+    while (true) {
+        counters.nodes++;
+        int c = cellIndex(cell[0], cell[1], cell[2]);
+        for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+            int index = cellObjects[k];
+            if (box.stamps[index] == box.ray)
+                continue;
+            box.stamps[index] = box.ray;
+            counters.prims++;
+            if (AnyHit) {
+                if (occluded_object(*objects[index], closedSet, r, t_min, closest))
+                    return true;
+            } else if (intersect_object(*objects[index], closedSet, r, t_min, closest, *rec)) {
+                hit_anything = true;
+                closest = rec->t;
+            }
+        }
+
+        // step across the nearest boundary, unless the closest hit or the
+        // end of the grid lies before it
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        if (closest <= tNext[axis] || tNext[axis] > t1)
+            break;
+        cell[axis] += step[axis];
+        if (cell[axis] == end[axis])
+            break;
+        tNext[axis] += tDelta[axis];
+    }
+    return hit_anything;
+}
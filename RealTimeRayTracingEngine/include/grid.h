@@ -0,0 +1,67 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "hittable.h"
+#include "accelerator.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using std::shared_ptr;
+
+// Uniform grid over a fixed set of objects. Each object is listed in every
+// cell its bounding box overlaps, and rays walk the cells they pass through
+// in order with a 3D-DDA, stopping at the first cell that ends beyond the
+// closest hit. The resolution follows the object density.
+//
+// Objects far larger than the typical one (a ground sphere, say) would be
+// listed in most cells and stretch the grid over empty space, so they are
+// kept out of it and tested for every ray, together with unbounded ones.
+class grid : public accelStructure
+{
+public:
+    explicit grid(const std::vector<shared_ptr<hittable>>& objects);
+
+    // Rebuilds the cells: a build costs about as much as a pass over the
+    // objects, and moved objects may change which ones count as large.
+    virtual bool refit(const std::vector<int>& objectIndices) override;
+    virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+    virtual bool bounding_box(aabb& output_box) const override;
+
+    virtual const AccelStats& stats() const override { return buildStats; }
+
+private:
+    // Cells per object the resolution aims for
+    static constexpr float CELLS_PER_OBJECT = 3.0f;
+    static const int MAX_RESOLUTION = 512;
+    // Objects whose largest extent is this many times the median one are large
+    static constexpr float LARGE_OBJECT_RATIO = 16.0f;
+
+    // the constructor's list, kept for rebuilds
+    std::vector<shared_ptr<hittable>> objects;
+    // objects outside the grid, tested for every ray
+    std::vector<shared_ptr<hittable>> unculled;
+    aabb bounds;
+    int resolution[3];
+    vec3 cellSize, invCellSize;
+    // cell c lists cellObjects[cellStart[c]] up to cellObjects[cellStart[c + 1]],
+    // as indices into objects
+    std::vector<int> cellStart;
+    std::vector<int> cellObjects;
+    // tells this build's mailboxes apart from those of any other grid
+    uint32_t buildId;
+    AccelStats buildStats;
+
+    void buildAll();
+    // closest hit into rec as intersect leaves it, or with AnyHit the first
+    // one found and no record
+    template <bool AnyHit>
+    bool traverse(const ray& r, float t_min, float t_max, hit_record* rec) const;
+    int cellIndex(int x, int y, int z) const { return (z * resolution[1] + y) * resolution[0] + x; }
+    int cellCoord(float p, int axis) const;
+};
+
+#endif
@@ -4,7 +4,7 @@
 #include <cmath>
 #include <limits>
 #include <memory>
-#include <cstdlib>
+#include <cstdint>
 
 using std::shared_ptr;
 using std::make_shared;
@@ -22,14 +22,54 @@ inline float clamp(float x, float min, float max) {
     return x;
 }
 
-inline float random_float() {
+// Mixes two values into a well distributed 32-bit seed
+inline uint32_t hash_seed(uint32_t a, uint32_t b) {
+    uint32_t h = a * 0x9E3779B9u ^ (b + 0x7F4A7C15u + (a << 6) + (a >> 2));
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// PCG32 (O'Neill, pcg-random.org): 64 bits of state, 32-bit output and a
+// selectable stream. Every sampling function takes the generator explicitly,
+// so there is no hidden shared state and a frame can be replayed exactly.
+class pcg32 {
+public:
+    pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+    pcg32(uint64_t initstate, uint64_t initseq) { seed(initstate, initseq); }
+
+    void seed(uint64_t initstate, uint64_t initseq) {
+        state = 0;
+        inc = (initseq << 1u) | 1u;
+        next_uint();
+        state += initstate;
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = static_cast<uint32_t>(old >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+private:
+    uint64_t state;
+    uint64_t inc;
+};
+
+inline float random_float(pcg32& rng) {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0f);
+    return (rng.next_uint() >> 8) * (1.0f / 16777216.0f);
 }
 
-inline float random_float(float min, float max) {
+inline float random_float(pcg32& rng, float min, float max) {
     // Returns a random real in [min,max).
-    return min + (max-min)*random_float();
+    return min + (max-min)*random_float(rng);
 }
 
 #endif
\ No newline at end of file
@@ -2,15 +2,28 @@
 #define HITTABLE_H
 
 #include "ray.h"
+#include "aabb.h"
 
-class material;
+#include <cstdint>
+
+class hittable;
 
 struct hit_record {
     point3 p;
     vec3 normal;
     double t;
-    shared_ptr<material> mat_ptr;
+    // index into the scene's materialTable
+    uint32_t mat_id;
     bool front_face;
+    // After hittable::intersect only t and these are set: the object whose
+    // fill_record works out the rest, and which of its primitives was hit.
+    // Null once the record is complete.
+    const hittable* object = nullptr;
+    int prim = 0;
+    // Set by an instance that leaves the record to the object it wraps:
+    // that object, which the instance completes it through. Only the
+    // object in object reads it.
+    const hittable* inner = nullptr;
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
@@ -18,12 +31,62 @@ struct hit_record {
     }
 };
 
+// Object types the closed-set dispatch (see dispatch.h) calls directly
+enum class HittableKind {
+    Sphere,
+    // anything else, only reachable through the virtual calls
+    Other
+};
+
 class hittable
 {
 public:
+   explicit hittable(HittableKind kind = HittableKind::Other) : hittableKind(kind) {}
+   virtual ~hittable() {}
+   HittableKind kind() const { return hittableKind; }
+
    virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
+   // hit without the shading data: finds the nearest hit between t_min and
+   // t_max but sets only rec.t, rec.object and rec.prim, leaving the point,
+   // normal and material to complete_record. Traversal tests many candidates
+   // and keeps one, so only the one kept is completed. rec is left alone on
+   // a miss. The default asks hit and returns a complete record.
+   virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+       hit_record full;
+       if (!hit(r, t_min, t_max, full))
+           return false;
+       rec = full;
+       rec.object = nullptr;
+       return true;
+   }
+   // The rest of a record intersect left to this object
+   virtual void fill_record(const ray&, hit_record&) const {}
+   // Whether anything lies on r between t_min and t_max. Meant for shadow
+   // and visibility rays: it may stop at the first intersection it finds and
+   // produces no hit data. The default just asks hit.
+   virtual bool occluded(const ray& r, float t_min, float t_max) const {
+       hit_record rec;
+       return hit(r, t_min, t_max, rec);
+   }
+   // Box enclosing the object; false if it is unbounded
+   virtual bool bounding_box(aabb& output_box) const = 0;
+
+   // Whether the bounds changed since an acceleration structure last looked
+   virtual bool is_dirty() const { return false; }
+   virtual void clear_dirty() {}
+
+private:
+   HittableKind hittableKind;
 };
 
+// Fills in whatever intersect left out of rec, for the ray it was found with
+inline void complete_record(const ray& r, hit_record& rec) {
+    if (rec.object) {
+        const hittable* object = rec.object;
+        rec.object = nullptr;
+        object->fill_record(r, rec);
+    }
+}
 
 
 #endif
\ No newline at end of file
@@ -1,17 +1,58 @@
 #include "hittableList.h"
+#include "accelerator.h"
+#include "dispatch.h"
 
 bool hittableList::hit(const ray& r, float t_min, float t_max, hit_record& rec) const{
-    hit_record tmp;
+    if (!intersect(r, t_min, t_max, rec))
+        return false;
+    complete_record(r, rec);
+    return true;
+}
+
+bool hittableList::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const{
+    TraversalCounters& counters = traversal_counters();
+    bool closedSet = closed_set_dispatch();
+    counters.rays++;
+    counters.prims += objects.size();
+
+    // candidates only set t and the object, so each can go straight into rec
     bool is_hit = false;
     float cloest_p = t_max;
 
     for (const auto &object : objects)
     {
-        if(object->hit(r, t_min, cloest_p, tmp)){
+        if(intersect_object(*object, closedSet, r, t_min, cloest_p, rec)){
             is_hit = true;
-            cloest_p = tmp.t;
-            rec = tmp;
+            cloest_p = rec.t;
         }
     }
     return is_hit;
-}
\ No newline at end of file
+}
+
+bool hittableList::occluded(const ray& r, float t_min, float t_max) const {
+    TraversalCounters& counters = traversal_counters();
+    bool closedSet = closed_set_dispatch();
+    counters.rays++;
+
+    for (const auto &object : objects) {
+        counters.prims++;
+        if (occluded_object(*object, closedSet, r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
+bool hittableList::bounding_box(aabb& output_box) const {
+    if (objects.empty())
+        return false;
+
+    aabb box;
+    aabb temp_box;
+    for (const auto &object : objects) {
+        if (!object->bounding_box(temp_box))
+            return false;
+        box.grow(temp_box);
+    }
+    output_box = box;
+    return true;
+}
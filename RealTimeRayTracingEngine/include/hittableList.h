@@ -2,6 +2,7 @@
 #define HITTABLE_LIST_H
 
 #include "hittable.h"
+#include "materialTable.h"
 
 #include <memory>
 #include <vector>
@@ -14,6 +15,8 @@ class hittableList : public hittable
 private:
     //a list of hittable pointers
     std::vector<shared_ptr<hittable>> objects;
+    // the materials the objects refer to, when this list is a whole scene
+    materialTable materials;
 
 public:
     hittableList() {}
@@ -28,6 +31,12 @@ public:
         }
         return objects[index];
     }
+    const std::vector<shared_ptr<hittable>>& get_objects() const { return objects; }
+    materialTable& get_materials() { return materials; }
+    const materialTable& get_materials() const { return materials; }
     virtual bool hit( const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+    virtual bool bounding_box(aabb& output_box) const override;
 };
 #endif
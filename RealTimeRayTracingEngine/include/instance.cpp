@@ -0,0 +1,70 @@
+#include "instance.h"
+
+instance::instance(shared_ptr<hittable> geometry, const transform& xf, uint32_t mat)
+    : geometry(geometry), xf(xf), mat_id(mat), dirty(false) {
+    bounded = geometry->bounding_box(objectBox);
+    if (bounded)
+        worldBox = xf.apply_box(objectBox);
+}
+
+void instance::set_transform(const transform& t) {
+    xf = t;
+    if (bounded)
+        worldBox = xf.apply_box(objectBox);
+    dirty = true;
+}
+
+// The direction is not renormalized, so distances along the object space ray
+// are the same t as along the world space one
+bool instance::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (!geometry->hit(to_local(r), t_min, t_max, rec))
+        return false;
+    to_world(r, rec);
+    return true;
+}
+
+bool instance::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    ray local = to_local(r);
+    hit_record found;
+    if (!geometry->intersect(local, t_min, t_max, found))
+        return false;
+
+    rec.t = found.t;
+    if (found.object && !found.inner) {
+        // the transform is applied only if this hit ends up the closest
+        rec.object = this;
+        rec.inner = found.object;
+        rec.prim = found.prim;
+        return true;
+    }
+    // Complete, or left to another instance inside the geometry: the record
+    // has room for one deferred transform, so finish this one now
+    complete_record(local, found);
+    to_world(r, found);
+    rec = found;
+    return true;
+}
+
+void instance::fill_record(const ray& r, hit_record& rec) const {
+    rec.inner->fill_record(to_local(r), rec);
+    to_world(r, rec);
+}
+
+void instance::to_world(const ray& r, hit_record& rec) const {
+    // the normal already faces against the local ray, and so against r
+    rec.p = r.at(rec.t);
+    rec.normal = unit_vector(xf.apply_normal(rec.normal));
+    if (mat_id != materialTable::NONE)
+        rec.mat_id = mat_id;
+}
+
+bool instance::occluded(const ray& r, float t_min, float t_max) const {
+    return geometry->occluded(to_local(r), t_min, t_max);
+}
+
+bool instance::bounding_box(aabb& output_box) const {
+    if (!bounded)
+        return false;
+    output_box = worldBox;
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "transform.h"
+#include "materialTable.h"
+
+// One placement of shared geometry. The geometry, typically an acceleration
+// structure built once over its own objects (the bottom level), is stored
+// once however many instances use it; an instance only adds a transform and
+// an optional material. Putting instances in the scene's hittableList makes
+// the renderer's accelerator the top level, so moving an instance refits
+// that and leaves the geometry alone.
+//
+// The geometry must not change after instances of it have been made.
+class instance : public hittable
+{
+public:
+    // mat, if given, replaces the geometry's own materials
+    instance(shared_ptr<hittable> geometry, const transform& xf, uint32_t mat = materialTable::NONE);
+
+    shared_ptr<hittable> get_geometry() const {return geometry;}
+    const transform& get_transform() const {return xf;}
+    uint32_t get_material() const {return mat_id;}
+
+    void set_transform(const transform& t);
+    void set_material(uint32_t mat){mat_id = mat;}
+
+    virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual void fill_record(const ray& r, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+    virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool is_dirty() const override {return dirty;}
+    virtual void clear_dirty() override {dirty = false;}
+
+private:
+    shared_ptr<hittable> geometry;
+    // object to world
+    transform xf;
+    uint32_t mat_id;
+    // the geometry's bounds, and those after the transform
+    aabb objectBox;
+    aabb worldBox;
+    bool bounded;
+    bool dirty;
+
+    ray to_local(const ray& r) const {
+        return ray(xf.apply_inverse_point(r.origin()), xf.apply_inverse_vector(r.direction()));
+    }
+    // Moves a record completed in object space to world space
+    void to_world(const ray& r, hit_record& rec) const;
+};
+
+#endif
@@ -4,21 +4,36 @@
 #include "hitUtils.h"
 #include "hittableList.h"
 
+// Lets shading group hits by the kind of material they landed on
+enum class MaterialType {
+    Lambertian,
+    Metal,
+    Dielectric,
+    // any other material, only reachable through scatter
+    Other
+};
+
 class material {
 public:
+    explicit material(MaterialType type = MaterialType::Other) : materialType(type) {}
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng
     ) const = 0;
+    // a tag rather than a virtual call, so dispatching on it costs a load
+    MaterialType type() const { return materialType; }
+
+private:
+    MaterialType materialType;
 };
 
 class lambertian : public material {
     public:
-        lambertian(const color& a) : albedo(a) {}
+        lambertian(const color& a) : material(MaterialType::Lambertian), albedo(a) {}
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng
         ) const override {
 
-            auto scatter_direction = rec.normal + random_unit_vector();
+            auto scatter_direction = rec.normal + random_unit_vector(rng);
 
             // Catch degenerate scatter direction
             if (scatter_direction.near_zero())
@@ -38,13 +53,13 @@ class lambertian : public material {
 
 class metal : public material {
     public:
-        metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+        metal(const color& a, double f) : material(MaterialType::Metal), albedo(a), fuzz(f < 1 ? f : 1) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng
         ) const override {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
+            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(rng));
             attenuation = get_albedo();
             return (dot(scattered.direction(), rec.normal) > 0);
         }
@@ -59,10 +74,10 @@ class metal : public material {
 
 class dielectric : public material {
     public:
-        dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+        dielectric(double index_of_refraction) : material(MaterialType::Dielectric), ir(index_of_refraction) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, pcg32&
         ) const override {
             attenuation = color(1.0, 1.0, 1.0);
             double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
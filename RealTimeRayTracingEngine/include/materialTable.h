@@ -0,0 +1,40 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using std::shared_ptr;
+
+class material;
+
+// The materials of a scene. Objects and hit records refer to them by a
+// 32-bit id rather than holding a shared_ptr, so copying a hit record while
+// tracing touches no reference counts.
+//
+// A table copied along with its scene shares the materials, so an edit made
+// through either copy shows in both.
+class materialTable
+{
+public:
+    // no material; an instance without one keeps its geometry's
+    static const uint32_t NONE = 0xffffffff;
+
+    // Adds mat and returns its id
+    uint32_t add(shared_ptr<material> mat) {
+        materials.push_back(mat);
+        return static_cast<uint32_t>(materials.size() - 1);
+    }
+    // For editing a material in place; tell the renderer afterwards
+    shared_ptr<material> get(uint32_t id) const { return materials[id]; }
+    const material& operator[](uint32_t id) const { return *materials[id]; }
+
+    uint32_t size() const { return static_cast<uint32_t>(materials.size()); }
+    void clear() { materials.clear(); }
+
+private:
+    std::vector<shared_ptr<material>> materials;
+};
+
+#endif
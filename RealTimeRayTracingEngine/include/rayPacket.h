@@ -0,0 +1,30 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "ray.h"
+
+// Rays traced together, stored one component per array so SIMD code loads
+// the same component of four rays at once. Meant for coherent rays such as
+// the camera rays of a small block of pixels. Lanes from count on are unused.
+struct alignas(16) rayPacket {
+    // a 4x4 pixel block
+    static const int SIZE = 16;
+
+    float ox[SIZE], oy[SIZE], oz[SIZE];
+    float dx[SIZE], dy[SIZE], dz[SIZE];
+    int count = 0;
+
+    void add(const ray& r) {
+        vec3 o = r.origin();
+        vec3 d = r.direction();
+        ox[count] = o.x(); oy[count] = o.y(); oz[count] = o.z();
+        dx[count] = d.x(); dy[count] = d.y(); dz[count] = d.z();
+        count++;
+    }
+
+    ray get(int lane) const {
+        return ray(vec3(ox[lane], oy[lane], oz[lane]), vec3(dx[lane], dy[lane], dz[lane]));
+    }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "renderThread.h"
+
+RenderThread::RenderThread(Renderer& renderer)
+    : renderer(renderer), running(true), cameraPending(false), frameBudgetMs(0.0), frameCount(0) {
+    thread = std::thread(&RenderThread::run, this);
+}
+
+RenderThread::~RenderThread() {
+    stop();
+}
+
+void RenderThread::stop() {
+    {
+        std::lock_guard<std::mutex> lock(pendingMtx);
+        running = false;
+        cancelToken.cancel();
+    }
+    if (thread.joinable())
+        thread.join();
+}
+
+void RenderThread::setCamera(const Camera& cam) {
+    std::lock_guard<std::mutex> lock(pendingMtx);
+    if (cam != lastCamera)
+        cancelToken.cancel();
+    lastCamera = cam;
+    pendingCamera = cam;
+    cameraPending = true;
+}
+
+void RenderThread::submit(const std::function<void(Renderer&)>& edit) {
+    std::lock_guard<std::mutex> lock(pendingMtx);
+    pendingEdits.push_back(edit);
+    cancelToken.cancel();
+}
+
+void RenderThread::setFrameBudget(double budgetMs) {
+    std::lock_guard<std::mutex> lock(pendingMtx);
+    frameBudgetMs = budgetMs;
+}
+
+double RenderThread::applyPending() {
+    std::vector<std::function<void(Renderer&)>> edits;
+    Camera cam;
+    bool hasCamera;
+    double budget;
+    {
+        // only swap under the lock so the UI thread is never held up by an edit;
+        // anything submitted after this point cancels the coming frame
+        std::lock_guard<std::mutex> lock(pendingMtx);
+        edits.swap(pendingEdits);
+        cam = pendingCamera;
+        hasCamera = cameraPending;
+        cameraPending = false;
+        budget = frameBudgetMs;
+        if (running)
+            cancelToken.reset();
+    }
+
+    for (const auto &edit : edits)
+        edit(renderer);
+    if (hasCamera)
+        renderer.updateCamera(cam);
+    return budget;
+}
+
+void RenderThread::run() {
+    while (running) {
+        RenderOptions options;
+        options.cancel = &cancelToken;
+        double budget = applyPending();
+        if (budget > 0)
+            options.deadline = std::chrono::steady_clock::now()
+                + std::chrono::microseconds(static_cast<long long>(budget * 1000.0));
+
+        // a cancelled frame is still published: its tiles are finished, only fewer of them
+        RenderResult result = renderer.renderScene(options);
+
+        Frame& frame = frames.writeBuffer();
+        frame.pixels = renderer.getPixels();
+        frame.stats = renderer.getStats();
+        frame.result = result;
+        frame.id = ++frameCount;
+        frames.publish();
+    }
+}
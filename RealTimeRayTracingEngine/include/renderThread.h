@@ -0,0 +1,68 @@
+#ifndef RENDER_THREAD_H
+#define RENDER_THREAD_H
+
+#include "renderer.h"
+#include "tripleBuffer.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A finished frame as handed from the render thread to the UI
+struct Frame {
+    std::vector<unsigned char> pixels;
+    RenderStats stats;
+    RenderResult result;
+    unsigned long id = 0;
+};
+
+// Runs a Renderer on its own thread so the UI loop never waits for a frame.
+// Once started, the renderer and its scene belong to the render thread: the
+// UI only talks to it through setCamera/submit and reads back whole frames.
+class RenderThread {
+public:
+    explicit RenderThread(Renderer& renderer);
+    ~RenderThread();
+
+    void stop();
+
+    // Only the most recent camera is kept; it is applied before the next frame.
+    // A camera that differs from the previous one cancels the frame in progress.
+    void setCamera(const Camera& cam);
+    // Queues a change to the renderer or its scene, run in submission order
+    // between two frames on the render thread. Cancels the frame in progress.
+    void submit(const std::function<void(Renderer&)>& edit);
+    // Stops each frame after about budgetMs; <= 0 renders whole frames
+    void setFrameBudget(double budgetMs);
+
+    // Makes the newest completed frame current; false if there is none since the last call
+    bool acquireFrame() { return frames.update(); }
+    const Frame& currentFrame() const { return frames.readBuffer(); }
+
+private:
+    Renderer& renderer;
+    std::thread thread;
+    std::atomic<bool> running;
+
+    std::mutex pendingMtx;
+    std::vector<std::function<void(Renderer&)>> pendingEdits;
+    Camera pendingCamera;
+    Camera lastCamera;
+    bool cameraPending;
+    double frameBudgetMs;
+    CancelToken cancelToken;
+
+    TripleBuffer<Frame> frames;
+    unsigned long frameCount;
+
+    RenderThread(const RenderThread&);
+    RenderThread& operator=(const RenderThread&);
+
+    void run();
+    // Returns the frame budget to use for the next frame
+    double applyPending();
+};
+
+#endif
@@ -1,86 +1,804 @@
 #include "renderer.h"
 #include "material.h"
+#include "dispatch.h"
+#include "bvh.h"
+#include "bvh4.h"
+#include "grid.h"
+#include "sphereList.h"
 
-Renderer::Renderer(int width, int height, int samplesPerPixel, int maxDepth)
-    : imgWidth(width), imgHeight(height), spp(samplesPerPixel), maxDepth(maxDepth) {
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+// passed to std::min by reference, so it needs a definition
+const int Renderer::WAVEFRONT_BATCH;
+
+Renderer::Renderer(int width, int height, int samplesPerPixel, int maxDepth, int numThreads)
+    : imgWidth(width), imgHeight(height), spp(samplesPerPixel), maxDepth(maxDepth),
+      accelKind(Accelerator::BVH), bvhBuilder(BvhBuilder::SAH), renderWidth(width), renderHeight(height), renderScale(1.0f), targetFrameMs(0.0),
+      accumulationValid(false), accumulatedSamples(0), adaptive(false), noiseThreshold(0.02f),
+      minAdaptiveSamples(16), debugView(DebugView::None), frameSamples(0), frameRays(0), convergedPixels(0),
+      traversalRays(0), traversalNodes(0), traversalPrims(0),
+      roulette(false), rouletteMinBounces(3), packets(true), integrator(Integrator::DepthFirst), pool(numThreads), seed(0), frameIndex(0), tileSize(32) {
     pixels.resize(width * height * 3);
+    lowResPixels.resize(width * height * 3);
+    accumulation.resize(width * height * 3);
+    sampleCount.resize(width * height);
+    luminanceSq.resize(width * height);
+    buildTiles();
 }
 
 void Renderer::setScene(const hittableList& world, const Camera& camera) {
     this->world = world;
     this->camera = camera;
+    buildAccelerator();
+    resetAccumulation();
+}
+
+void Renderer::geometryChanged() {
+    std::vector<int> dirty;
+    const auto& objects = world.get_objects();
+    for (size_t i = 0; i < objects.size(); i++)
+        if (objects[i]->is_dirty())
+            dirty.push_back(static_cast<int>(i));
+    refitAccelerator(dirty);
+    resetAccumulation();
+}
+
+void Renderer::geometryChanged(int objectIndex) {
+    refitAccelerator(std::vector<int>(1, objectIndex));
+    resetAccumulation();
+}
+
+void Renderer::refitAccelerator(const std::vector<int>& objectIndices) {
+    if (accel) {
+        accel->refit(objectIndices);
+        accelStats = accel->stats();
+    } else {
+        for (int index : objectIndices)
+            if (auto obj = world.get(index))
+                obj->clear_dirty();
+    }
+}
+
+void Renderer::setAccelerator(Accelerator kind) {
+    accelKind = kind;
+    buildAccelerator();
+}
+
+void Renderer::setBvhBuilder(BvhBuilder builder) {
+    bvhBuilder = builder;
+    buildAccelerator();
+}
+
+void Renderer::buildAccelerator() {
+    switch (accelKind) {
+    case Accelerator::BVH:
+        accel = make_shared<bvh>(world.get_objects(), 4, bvhBuilder, &pool);
+        break;
+    case Accelerator::BVH4:
+        accel = make_shared<bvh4>(world.get_objects(), 4, bvhBuilder, &pool);
+        break;
+    case Accelerator::BVH4Quantized:
+        accel = make_shared<bvh4>(world.get_objects(), 4, bvhBuilder, &pool, true);
+        break;
+    case Accelerator::Grid:
+        accel = make_shared<grid>(world.get_objects());
+        break;
+    case Accelerator::SphereList:
+        accel = make_shared<sphereList>(world.get_objects());
+        break;
+    case Accelerator::List:
+    default:
+        accel.reset();
+        break;
+    }
+
+    if (accel) {
+        scene = accel;
+        accelStats = accel->stats();
+    } else {
+        // non-owning: world lives as long as the renderer
+        scene = shared_ptr<hittable>(shared_ptr<hittable>(), &world);
+        accelStats = AccelStats();
+    }
 }
 
 void Renderer::renderScene() {
-    for (int j = 0; j < imgHeight; j++) {
+    renderScene(RenderOptions());
+}
+
+RenderResult Renderer::renderScene(const RenderOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+
+    if (!accumulationValid) {
+        std::fill(accumulation.begin(), accumulation.end(), 0.0f);
+        std::fill(sampleCount.begin(), sampleCount.end(), 0);
+        std::fill(luminanceSq.begin(), luminanceSq.end(), 0.0f);
+        for (auto &tile : tiles)
+            tile.passes = 0;
+        accumulatedSamples = 0;
+        accumulationValid = true;
+    }
+    std::atomic<long long> tileNs(0);
+    std::atomic<int> tilesDone(0);
+    std::atomic<bool> cancelled(false);
+    frameSamples = 0;
+    frameRays = 0;
+    convergedPixels = 0;
+    traversalRays = 0;
+    traversalNodes = 0;
+    traversalPrims = 0;
+
+    // tiles left out by an earlier interrupted frame go first, the rest in spiral order
+    tileOrder.resize(tiles.size());
+    for (size_t t = 0; t < tiles.size(); t++)
+        tileOrder[t] = static_cast<int>(t);
+    std::stable_sort(tileOrder.begin(), tileOrder.end(), [this](int a, int b) {
+        return tiles[a].passes < tiles[b].passes;
+    });
+
+    int total = static_cast<int>(tiles.size());
+    pool.parallelFor(total, [&](int t) {
+        if (options.cancel && options.cancel->cancelled()) {
+            cancelled = true;
+            return;
+        }
+        auto tileStart = std::chrono::steady_clock::now();
+        if (tileStart >= options.deadline)
+            return;
+
+        Tile& tile = tiles[tileOrder[t]];
+        renderTile(tile);
+        tile.passes++;
+
+        TraversalCounters& counters = traversal_counters();
+        traversalRays += counters.rays;
+        traversalNodes += counters.nodes;
+        traversalPrims += counters.prims;
+        counters = TraversalCounters();
+        tileNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - tileStart).count();
+
+        int done = ++tilesDone;
+        if (options.progress) {
+            std::lock_guard<std::mutex> lock(progressMtx);
+            options.progress(static_cast<float>(done) / total);
+        }
+    });
+    frameIndex++;
+
+    RenderResult result;
+    result.tilesDone = tilesDone;
+    result.tilesTotal = total;
+    result.complete = tilesDone == total;
+    result.cancelled = cancelled;
+    result.samples = frameSamples;
+
+    // samples every pixel has; tiles an interrupted frame got to are ahead
+    if (result.complete)
+        accumulatedSamples += spp;
+
+    const SchedulerStats sched = pool.lastStats();
+    // a frame cut off before its first tile leaves the last output as it was
+    if ((renderWidth != imgWidth || renderHeight != imgHeight) && result.tilesDone > 0)
+        upscale();
+
+    stats.frameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    stats.renderScale = renderScale;
+    stats.renderWidth = renderWidth;
+    stats.renderHeight = renderHeight;
+    stats.accumulatedSamples = accumulatedSamples;
+    stats.frameSamples = frameSamples;
+    stats.frameRays = frameRays;
+    stats.accel = accelStats;
+    stats.traversal.rays = traversalRays;
+    stats.traversal.nodes = traversalNodes;
+    stats.traversal.prims = traversalPrims;
+    stats.convergedPixels = convergedPixels;
+    stats.tileSize = tileSize;
+    stats.tiles = result.tilesDone;
+    stats.steals = sched.steals;
+    stats.idleMs = sched.idleMs;
+
+    // a new tile layout forgets which tiles are behind, so only change it after a full frame
+    if (result.complete)
+        adaptTileSize(tileNs * 1e-6 / total);
+    // Frames cut short by a camera move, an edit or the deadline count too,
+    // projected to all tiles, or the scale would never adapt while the view
+    // keeps changing
+    if (targetFrameMs > 0 && result.tilesDone > 0)
+        adaptRenderScale(stats.frameMs * total / result.tilesDone);
+    return result;
+}
+
+void Renderer::setAdaptiveSampling(bool enabled, float threshold, int minSamples) {
+    adaptive = enabled;
+    noiseThreshold = threshold;
+    minAdaptiveSamples = std::max(minSamples, 2);
+}
+
+void Renderer::setIntegrator(Integrator mode) {
+    integrator = mode;
+    resetAccumulation();
+}
+
+void Renderer::setPacketTracing(bool enabled) {
+    packets = enabled;
+    resetAccumulation();
+}
+
+void Renderer::setRussianRoulette(bool enabled, int minBounces) {
+    roulette = enabled;
+    rouletteMinBounces = std::max(minBounces, 0);
+    resetAccumulation();
+}
+
+static float luminance(const color& c) {
+    return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+}
+
+// Sky gradient seen by rays that leave the scene
+static color background(const ray& r) {
+    vec3 unit_direction = unit_vector(r.direction());
+    auto t = 0.5f *(unit_direction.y() + 1.0f);
+    return (1.0f-t)*color(1.0f, 1.0f, 1.0f) + t*color(0.5f, 0.7f, 1.0f);
+}
+
+bool Renderer::converged(int pixel) const {
+    int n = sampleCount[pixel];
+    if (!adaptive || n < minAdaptiveSamples)
+        return false;
+
+    const float* acc = &accumulation[pixel * 3];
+    float sum = 0.2126f * acc[0] + 0.7152f * acc[1] + 0.0722f * acc[2];
+    float mean = sum / n;
+    float variance = std::max(luminanceSq[pixel] - sum * mean, 0.0f) / (n - 1);
+    // the small floor lets black pixels converge instead of dividing by zero
+    float stdError = sqrt(variance / n);
+    return stdError <= noiseThreshold * std::max(mean, 1e-3f);
+}
+
+void Renderer::setTargetFrameTime(double targetMs) {
+    targetFrameMs = targetMs;
+    if (targetFrameMs <= 0)
+        setRenderScale(1.0f);
+}
+
+void Renderer::setRenderScale(float scale) {
+    renderScale = scale;
+    int w = std::max(1, static_cast<int>(imgWidth * scale + 0.5f));
+    int h = std::max(1, static_cast<int>(imgHeight * scale + 0.5f));
+    if (w == renderWidth && h == renderHeight)
+        return;
+
+    // the accumulated samples belong to the old pixel grid
+    renderWidth = w;
+    renderHeight = h;
+    buildTiles();
+    resetAccumulation();
+    // so tiles the next frame does not get to show the last output rather
+    // than rows laid out for the old width
+    downscale();
+}
+
+// Frame cost is roughly proportional to the pixel count, i.e. the scale
+// squared. Only react outside a tolerance band and in 5% steps, since every
+// change of resolution restarts accumulation.
+void Renderer::adaptRenderScale(double frameMs) {
+    if (frameMs <= targetFrameMs * 1.1 && frameMs >= targetFrameMs * 0.8)
+        return;
+
+    float ideal = renderScale * static_cast<float>(sqrt(targetFrameMs / frameMs));
+    // move halfway there to damp oscillation from noisy timings
+    float next = renderScale + 0.5f * (ideal - renderScale);
+    next = clamp(std::round(next * 20.0f) / 20.0f, MIN_RENDER_SCALE, 1.0f);
+    if (next != renderScale)
+        setRenderScale(next);
+}
+
+// Bilinear upscale of the internal frame to the full output size
+void Renderer::upscale() {
+    float sx = static_cast<float>(renderWidth) / imgWidth;
+    float sy = static_cast<float>(renderHeight) / imgHeight;
+
+    pool.parallelFor(imgHeight, [&](int j) {
+        float fy = clamp((j + 0.5f) * sy - 0.5f, 0.0f, renderHeight - 1.0f);
+        int y0 = static_cast<int>(fy);
+        int y1 = std::min(y0 + 1, renderHeight - 1);
+        float ty = fy - y0;
+
         for (int i = 0; i < imgWidth; i++) {
-            color pix_col;
-            //clamping with multi-sampled pixels
-            for (int s = 0; s < spp; s++){
-                //normalize the view point 
-                auto u = (i + random_float()) / (imgWidth-1);
-                auto v = (j + random_float()) / (imgHeight-1);
-
-                //construct the ray from camera
-                //color pix_col = ray_color(light_position, light_color, light_intensity, r, world);
-                ray rLight = camera.get_ray(u, v);
-                pix_col += ray_color(rLight, world, maxDepth);
+            float fx = clamp((i + 0.5f) * sx - 0.5f, 0.0f, renderWidth - 1.0f);
+            int x0 = static_cast<int>(fx);
+            int x1 = std::min(x0 + 1, renderWidth - 1);
+            float tx = fx - x0;
+
+            const unsigned char* p00 = &lowResPixels[(y0 * renderWidth + x0) * 3];
+            const unsigned char* p01 = &lowResPixels[(y0 * renderWidth + x1) * 3];
+            const unsigned char* p10 = &lowResPixels[(y1 * renderWidth + x0) * 3];
+            const unsigned char* p11 = &lowResPixels[(y1 * renderWidth + x1) * 3];
+            unsigned char* out = &pixels[(j * imgWidth + i) * 3];
+            for (int c = 0; c < 3; c++) {
+                float top = p00[c] + tx * (p01[c] - p00[c]);
+                float bottom = p10[c] + tx * (p11[c] - p10[c]);
+                out[c] = static_cast<unsigned char>(top + ty * (bottom - top) + 0.5f);
+            }
+        }
+    });
+}
+
+// Nearest-pixel copy of the output into the internal frame at its current size
+void Renderer::downscale() {
+    if (renderWidth == imgWidth && renderHeight == imgHeight)
+        return;
+    pool.parallelFor(renderHeight, [&](int j) {
+        int y = std::min(static_cast<int>((j + 0.5f) * imgHeight / renderHeight), imgHeight - 1);
+        for (int i = 0; i < renderWidth; i++) {
+            int x = std::min(static_cast<int>((i + 0.5f) * imgWidth / renderWidth), imgWidth - 1);
+            const unsigned char* in = &pixels[(y * imgWidth + x) * 3];
+            unsigned char* out = &lowResPixels[(j * renderWidth + i) * 3];
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+        }
+    });
+}
+
+// Orders the tiles in a square spiral starting at the image centre, where the
+// interesting (and expensive) geometry usually is. Consecutive tiles are
+// neighbours, and the deques hand them out centre first.
+void Renderer::buildTiles() {
+    int tilesX = (renderWidth + tileSize - 1) / tileSize;
+    int tilesY = (renderHeight + tileSize - 1) / tileSize;
+    float cx = (tilesX - 1) * 0.5f;
+    float cy = (tilesY - 1) * 0.5f;
+
+    struct Entry {
+        Tile tile;
+        float ring, angle;
+    };
+    std::vector<Entry> order;
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            Entry e;
+            e.tile.x0 = tx * tileSize;
+            e.tile.y0 = ty * tileSize;
+            e.tile.x1 = std::min(e.tile.x0 + tileSize, renderWidth);
+            e.tile.y1 = std::min(e.tile.y0 + tileSize, renderHeight);
+            e.tile.passes = 0;
+            float dx = tx - cx, dy = ty - cy;
+            e.ring = std::floor(std::max(std::fabs(dx), std::fabs(dy)) + 0.5f);
+            e.angle = std::atan2(dy, dx);
+            order.push_back(e);
+        }
+    }
+    std::sort(order.begin(), order.end(), [](const Entry& a, const Entry& b) {
+        return a.ring != b.ring ? a.ring < b.ring : a.angle < b.angle;
+    });
+
+    tiles.clear();
+    for (const auto &e : order)
+        tiles.push_back(e.tile);
+}
+
+// Small tiles balance better but cost more scheduling per pixel; grow them while
+// they are cheap and shrink them when they get slow or too few to go round.
+void Renderer::adaptTileSize(double tileMs) {
+    int newSize = tileSize;
+    bool tooFew = static_cast<int>(tiles.size()) < 4 * pool.size();
+    if ((tileMs > MAX_TILE_MS || tooFew) && tileSize > MIN_TILE_SIZE)
+        newSize = tileSize / 2;
+    else if (tileMs < MIN_TILE_MS && tileSize < MAX_TILE_SIZE) {
+        // don't grow into a layout that would immediately be too coarse again
+        int grownX = (renderWidth + 2 * tileSize - 1) / (2 * tileSize);
+        int grownY = (renderHeight + 2 * tileSize - 1) / (2 * tileSize);
+        if (grownX * grownY >= 4 * pool.size())
+            newSize = tileSize * 2;
+    }
+
+    if (newSize != tileSize) {
+        tileSize = newSize;
+        buildTiles();
+    }
+}
+
+void Renderer::renderTile(const Tile& tile) {
+    // frame and user seed in the high word, pixel in the low word: unique per (pixel, frame)
+    uint64_t frameSeed = static_cast<uint64_t>(hash_seed(seed, frameIndex)) << 32;
+    bool fullRes = renderWidth == imgWidth && renderHeight == imgHeight;
+    unsigned char* target = fullRes ? pixels.data() : lowResPixels.data();
+
+    // brightest end of the sample-count debug view
+    float maxSamples = static_cast<float>(accumulatedSamples + spp);
+    long long tileSamples = 0;
+    long long tileRays = 0;
+    int tileConverged = 0;
+
+    if (integrator == Integrator::Wavefront)
+        traceWavefront(tile, frameSeed, tileSamples, tileRays, tileConverged);
+    else
+        traceDepthFirst(tile, frameSeed, tileSamples, tileRays, tileConverged);
+
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            int pixel = j * renderWidth + i;
+            int n = sampleCount[pixel];
+            const float* acc = &accumulation[pixel * 3];
+
+            float r, g, b;
+            if (debugView == DebugView::SampleCount) {
+                // black - red - yellow - white heat map
+                float heat = n / maxSamples;
+                r = clamp(3.0f * heat, 0.0f, 1.0f);
+                g = clamp(3.0f * heat - 1.0f, 0.0f, 1.0f);
+                b = clamp(3.0f * heat - 2.0f, 0.0f, 1.0f);
+            } else {
+                //gamma-correct the average of every sample so far
+                auto scale = 1.0f / n;
+                r = sqrt(scale * acc[0]);
+                g = sqrt(scale * acc[1]);
+                b = sqrt(scale * acc[2]);
             }
-            
-            auto r = pix_col.x();
-            auto g = pix_col.y();
-            auto b = pix_col.z();
-
-            auto scale = 1.0 / spp;
-            r = sqrt(scale * r);
-            g = sqrt(scale * g);
-            b = sqrt(scale * b);
-
-            int index = (j * imgWidth + i) * 3;
-            pixels[index] = static_cast<unsigned char>(clamp(r, 0.0, 0.999) * 256);
-            pixels[index + 1] = static_cast<unsigned char>(clamp(g, 0.0, 0.999) * 256);
-            pixels[index + 2] = static_cast<unsigned char>(clamp(b, 0.0, 0.999) * 256);
+
+            int index = pixel * 3;
+            target[index] = static_cast<unsigned char>(clamp(r, 0.0, 0.999) * 256);
+            target[index + 1] = static_cast<unsigned char>(clamp(g, 0.0, 0.999) * 256);
+            target[index + 2] = static_cast<unsigned char>(clamp(b, 0.0, 0.999) * 256);
         }
     }
+
+    frameSamples += tileSamples;
+    frameRays += tileRays;
+    convergedPixels += tileConverged;
+}
+
+// Samples the tile's pixels one path after the other
+void Renderer::traceDepthFirst(const Tile& tile, uint64_t frameSeed, long long& samples, long long& rays,
+                               int& convergedCount) {
+    // Pixels are sampled in blocks so that with packet tracing the camera
+    // rays of a block are traced together; without it blocks are one pixel
+    static_assert(PACKET_SIZE * PACKET_SIZE <= rayPacket::SIZE, "a block must fit in one packet");
+    int block = packets && accel ? PACKET_SIZE : 1;
+    for (int by = tile.y0; by < tile.y1; by += block) {
+        for (int bx = tile.x0; bx < tile.x1; bx += block) {
+            int y1 = std::min(by + block, tile.y1);
+            int x1 = std::min(bx + block, tile.x1);
+
+            // the block's pixels still taking samples
+            int blockPixels[PACKET_SIZE * PACKET_SIZE];
+            color blockColor[PACKET_SIZE * PACKET_SIZE];
+            float blockLumSq[PACKET_SIZE * PACKET_SIZE];
+            int active = 0;
+            for (int j = by; j < y1; j++) {
+                for (int i = bx; i < x1; i++) {
+                    int pixel = j * renderWidth + i;
+                    if (converged(pixel)) {
+                        convergedCount++;
+                        continue;
+                    }
+                    blockPixels[active] = pixel;
+                    blockColor[active] = color(0, 0, 0);
+                    blockLumSq[active] = 0.0f;
+                    active++;
+                }
+            }
+
+            for (int s = 0; s < spp && active > 0; s++) {
+                // one stream per sample: the result doesn't depend on which thread runs the tile
+                pcg32 rngs[PACKET_SIZE * PACKET_SIZE];
+                rayPacket packet;
+                for (int k = 0; k < active; k++) {
+                    int pixel = blockPixels[k];
+                    int i = pixel % renderWidth;
+                    int j = pixel / renderWidth;
+                    rngs[k] = pcg32(frameSeed | static_cast<uint32_t>(pixel), sampleCount[pixel] + s);
+
+                    //normalize the view point
+                    auto u = (i + random_float(rngs[k])) / std::max(renderWidth-1, 1);
+                    auto v = (j + random_float(rngs[k])) / std::max(renderHeight-1, 1);
+
+                    //construct the ray from camera
+                    packet.add(camera.get_ray(u, v));
+                }
+
+                hit_record primary[PACKET_SIZE * PACKET_SIZE];
+                bool primaryHit[PACKET_SIZE * PACKET_SIZE];
+                if (block > 1 && maxDepth > 0) {
+                    // the camera rays together, then every path on its own
+                    accel->hit_packet(packet, 0.001f, infinity, primary, primaryHit);
+                    rays += active;
+                }
+                for (int k = 0; k < active; k++) {
+                    color sample = block > 1 && maxDepth > 0
+                        ? ray_color(packet.get(k), *scene, maxDepth, rngs[k], rays, &primary[k], primaryHit[k])
+                        : ray_color(packet.get(k), *scene, maxDepth, rngs[k], rays);
+                    blockColor[k] += sample;
+                    float lum = luminance(sample);
+                    blockLumSq[k] += lum * lum;
+                }
+            }
+
+            for (int k = 0; k < active; k++) {
+                int pixel = blockPixels[k];
+                float* acc = &accumulation[pixel * 3];
+                acc[0] += blockColor[k].x();
+                acc[1] += blockColor[k].y();
+                acc[2] += blockColor[k].z();
+                luminanceSq[pixel] += blockLumSq[k];
+                sampleCount[pixel] += spp;
+                samples += spp;
+            }
+        }
+    }
+}
+
+namespace {
+
+// One path of the wavefront integrator between bounces
+struct pathState {
+    ray r;
+    color throughput;
+    color radiance;
+    pcg32 rng;
+    // the path's pixel, as an index into the tile's sampled pixels
+    int slot;
+};
+
+// Per render thread and reused by every tile, so batches allocate only
+// while they grow
+struct wavefrontBuffers {
+    std::vector<pathState> paths;
+    // indices into paths of the paths still going, this bounce and the next
+    std::vector<int> active, next;
+    // per entry of active: its closest hit, the bin it goes to and whether
+    // its path goes on
+    std::vector<hit_record> hits;
+    std::vector<uint8_t> bins;
+    std::vector<uint8_t> alive;
+    // entries of active ordered by bin
+    std::vector<int> binned;
+    // the tile's sampled pixels and the sums of their samples this frame
+    std::vector<int> pixels;
+    std::vector<color> sums;
+    std::vector<float> lumSq;
+};
+
+wavefrontBuffers& wavefront_buffers() {
+    static thread_local wavefrontBuffers buffers;
+    return buffers;
+}
+
+// one bin per material type, and one for the paths that left the scene
+const int MATERIAL_BINS = static_cast<int>(MaterialType::Other) + 1;
+const int MISS_BIN = MATERIAL_BINS;
+
+// A qualified call on the concrete type is direct and can be inlined;
+// other materials go through the virtual call
+template <class M>
+inline bool scatter_as(const material& mat, const ray& r_in, const hit_record& rec, color& attenuation,
+                       ray& scattered, pcg32& rng) {
+    return static_cast<const M&>(mat).M::scatter(r_in, rec, attenuation, scattered, rng);
+}
+
+template <>
+inline bool scatter_as<material>(const material& mat, const ray& r_in, const hit_record& rec, color& attenuation,
+                                 ray& scattered, pcg32& rng) {
+    return mat.scatter(r_in, rec, attenuation, scattered, rng);
+}
+
+// Shades the hits binned[begin] to binned[end], all on materials of type M,
+// and marks the paths that scatter as alive
+template <class M>
+void shade_bin(wavefrontBuffers& w, const materialTable& materials, int begin, int end) {
+    for (int b = begin; b < end; b++) {
+        int k = w.binned[b];
+        pathState& path = w.paths[w.active[k]];
+        const hit_record& hit = w.hits[k];
+        ray scattered;
+        color attenuation;
+        // an absorbed path keeps its zero radiance
+        if (!scatter_as<M>(materials[hit.mat_id], path.r, hit, attenuation, scattered, path.rng))
+            continue;
+        path.throughput = path.throughput * attenuation;
+        path.r = scattered;
+        w.alive[k] = 1;
+    }
+}
+
+}
+
+// Samples the tile's pixels a bounce at a time. Paths are made in the order
+// the depth-first integrator takes its samples, consume their random numbers
+// in the same order and add up per pixel in the same order, so the two give
+// the same image.
+void Renderer::traceWavefront(const Tile& tile, uint64_t frameSeed, long long& samples, long long& rays,
+                              int& convergedCount) {
+    wavefrontBuffers& w = wavefront_buffers();
+    const materialTable& materials = world.get_materials();
+    bool closedSet = closed_set_dispatch();
+    w.pixels.clear();
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            int pixel = j * renderWidth + i;
+            if (converged(pixel))
+                convergedCount++;
+            else
+                w.pixels.push_back(pixel);
+        }
+    }
+    w.sums.assign(w.pixels.size(), color(0, 0, 0));
+    w.lumSq.assign(w.pixels.size(), 0.0f);
+
+    int total = static_cast<int>(w.pixels.size()) * spp;
+    for (int first = 0; first < total; first += WAVEFRONT_BATCH) {
+        int count = std::min(WAVEFRONT_BATCH, total - first);
+        w.paths.resize(count);
+        w.active.resize(count);
+        for (int p = 0; p < count; p++) {
+            int slot = (first + p) / spp;
+            int s = (first + p) % spp;
+            int pixel = w.pixels[slot];
+            pathState& path = w.paths[p];
+            path.rng = pcg32(frameSeed | static_cast<uint32_t>(pixel), sampleCount[pixel] + s);
+            auto u = (pixel % renderWidth + random_float(path.rng)) / std::max(renderWidth-1, 1);
+            auto v = (pixel / renderWidth + random_float(path.rng)) / std::max(renderHeight-1, 1);
+            path.r = camera.get_ray(u, v);
+            path.throughput = color(1, 1, 1);
+            path.radiance = color(0, 0, 0);
+            path.slot = slot;
+            w.active[p] = p;
+        }
+
+        for (int bounce = 0; bounce < maxDepth && !w.active.empty(); bounce++) {
+            if (roulette && bounce >= rouletteMinBounces) {
+                size_t kept = 0;
+                for (int index : w.active) {
+                    pathState& path = w.paths[index];
+                    const color& t = path.throughput;
+                    float survive = std::min(std::max(t.x(), std::max(t.y(), t.z())), 0.95f);
+                    if (random_float(path.rng) >= survive)
+                        continue;
+                    path.throughput /= survive;
+                    w.active[kept++] = index;
+                }
+                w.active.resize(kept);
+            }
+
+            // every intersection of the bounce, then a counting sort into bins
+            int n = static_cast<int>(w.active.size());
+            w.hits.resize(n);
+            w.bins.resize(n);
+            w.alive.assign(n, 0);
+            int binStart[MATERIAL_BINS + 2] = {};
+            // with packet tracing the camera rays go 16 at a time; a path's
+            // samples come one after the other, so a packet covers a few
+            // neighbouring pixels
+            bool usePackets = bounce == 0 && packets && accel;
+            for (int k = 0; usePackets && k < n; k += rayPacket::SIZE) {
+                rayPacket packet;
+                for (int q = k; q < std::min(k + rayPacket::SIZE, n); q++)
+                    packet.add(w.paths[w.active[q]].r);
+                bool found[rayPacket::SIZE];
+                accel->hit_packet(packet, 0.001f, infinity, &w.hits[k], found);
+                for (int q = 0; q < packet.count; q++)
+                    w.alive[k + q] = found[q];
+            }
+            for (int k = 0; k < n; k++) {
+                pathState& path = w.paths[w.active[k]];
+                rays++;
+                bool found = usePackets ? w.alive[k] != 0 : scene->hit(path.r, 0.001, infinity, w.hits[k]);
+                if (found) {
+                    w.bins[k] = static_cast<uint8_t>(materials[w.hits[k].mat_id].type());
+                } else {
+                    path.radiance = path.throughput * background(path.r);
+                    w.bins[k] = MISS_BIN;
+                }
+                binStart[w.bins[k] + 1]++;
+            }
+            for (int b = 0; b <= MATERIAL_BINS; b++)
+                binStart[b + 1] += binStart[b];
+            w.binned.resize(n);
+            int fill[MATERIAL_BINS + 1];
+            std::copy(binStart, binStart + MATERIAL_BINS + 1, fill);
+            for (int k = 0; k < n; k++)
+                w.binned[fill[w.bins[k]]++] = k;
+
+            // shade bin by bin
+            std::fill(w.alive.begin(), w.alive.end(), 0);
+            if (closedSet) {
+                shade_bin<lambertian>(w, materials, binStart[static_cast<int>(MaterialType::Lambertian)],
+                                      binStart[static_cast<int>(MaterialType::Lambertian) + 1]);
+                shade_bin<metal>(w, materials, binStart[static_cast<int>(MaterialType::Metal)],
+                                 binStart[static_cast<int>(MaterialType::Metal) + 1]);
+                shade_bin<dielectric>(w, materials, binStart[static_cast<int>(MaterialType::Dielectric)],
+                                      binStart[static_cast<int>(MaterialType::Dielectric) + 1]);
+                shade_bin<material>(w, materials, binStart[static_cast<int>(MaterialType::Other)],
+                                    binStart[static_cast<int>(MaterialType::Other) + 1]);
+            } else {
+                // every bin through the virtual call
+                shade_bin<material>(w, materials, 0, binStart[MISS_BIN]);
+            }
+
+            // the survivors make up the next bounce, still in pixel order
+            w.next.clear();
+            for (int k = 0; k < n; k++)
+                if (w.alive[k])
+                    w.next.push_back(w.active[k]);
+            w.active.swap(w.next);
+        }
+
+        // paths still going at the depth limit add nothing
+        for (int p = 0; p < count; p++) {
+            const pathState& path = w.paths[p];
+            w.sums[path.slot] += path.radiance;
+            float lum = luminance(path.radiance);
+            w.lumSq[path.slot] += lum * lum;
+        }
+    }
+
+    for (size_t slot = 0; slot < w.pixels.size(); slot++) {
+        int pixel = w.pixels[slot];
+        float* acc = &accumulation[pixel * 3];
+        acc[0] += w.sums[slot].x();
+        acc[1] += w.sums[slot].y();
+        acc[2] += w.sums[slot].z();
+        luminanceSq[pixel] += w.lumSq[slot];
+        sampleCount[pixel] += spp;
+        samples += spp;
+    }
 }
 
 const std::vector<unsigned char>& Renderer::getPixels() const {
     return pixels;
 }
 
-color Renderer::ray_color(const ray& r, hittableList world, int depth){
-    hit_record hit;
-
-    if (depth <= 0)
-        return color(0,0,0);
+// Iterative path tracer: the product of the attenuations so far is carried as
+// throughput instead of being applied on the way back out of a recursion
+color Renderer::ray_color(const ray& r, const hittable& world, int depth, pcg32& rng, long long& rays,
+                          const hit_record* primary, bool primaryHit) const {
+    const materialTable& materials = this->world.get_materials();
+    bool closedSet = closed_set_dispatch();
+    ray cur_ray = r;
+    color throughput(1, 1, 1);
 
-    if (world.hit(r, 0.001, infinity, hit)) {
-        // vec3 hit_point = r.at(hit.t);
-        // vec3 normal = unit_vector(hit_point - vec3(0, 0, -1)); // Normal at the hit point
+    for (int bounce = 0; bounce < depth; bounce++) {
+        if (roulette && bounce >= rouletteMinBounces) {
+            float survive = std::min(std::max(throughput.x(), std::max(throughput.y(), throughput.z())), 0.95f);
+            if (random_float(rng) >= survive)
+                return color(0,0,0);
+            throughput /= survive;
+        }
 
-        // vec3 to_light = unit_vector(light_position - hit_point); // Direction from hit point to light
-        // color effective_light_color = light_intensity * light_color;
+        hit_record hit;
+        bool found;
+        if (bounce == 0 && primary) {
+            hit = *primary;
+            found = primaryHit;
+        } else {
+            rays++;
+            found = world.hit(cur_ray, 0.001, infinity, hit);
+        }
 
-        // // Simple diffuse lighting calculation
-        // auto diffuse = std::max(dot(normal, to_light), 0.0f);
-        // color diffuse_color = diffuse * effective_light_color; // Use effective_light_color here
+        if (!found)
+            return throughput * background(cur_ray);
 
-        // // Combine with the object's base color
-        // color object_color = hit.normal + color(1, 1, 1); // Base color of the object
-        // return diffuse_color * object_color;
         ray scattered;
         color attenuation;
-        if (hit.mat_ptr->scatter(r, hit, attenuation, scattered))
-            return attenuation * ray_color(scattered, world, depth-1);
-        return color(0,0,0);
+        if (!scatter_material(materials[hit.mat_id], closedSet, cur_ray, hit, attenuation, scattered, rng))
+            return color(0,0,0);
+
+        throughput = throughput * attenuation;
+        cur_ray = scattered;
     }
 
-    // Background color
-    vec3 unit_direction = unit_vector(r.direction());
-    auto t = 0.5f *(unit_direction.y() + 1.0f);
-    return (1.0f-t)*color(1.0f, 1.0f, 1.0f) + t*color(0.5f, 0.7f, 1.0f);
+    // exceeded the bounce limit
+    return color(0,0,0);
 }
 
 void Renderer::updateCamera(const Camera &cam){
+    if (cam == camera)
+        return;
     this->camera = cam;
+    resetAccumulation();
 }
\ No newline at end of file
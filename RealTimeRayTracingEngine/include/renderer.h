@@ -3,22 +3,232 @@
 
 #include "camera.h"
 #include "hittableList.h"
+#include "threadPool.h"
+#include "accelerator.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+// Per-frame counters of the tile scheduler and the accumulation buffer
+struct RenderStats {
+    double frameMs = 0.0;
+    float renderScale = 1.0f;
+    int renderWidth = 0;
+    int renderHeight = 0;
+    // samples every pixel has had since accumulation started
+    int accumulatedSamples = 0;
+    // Adaptive sampling: samples traced this frame and pixels below the noise threshold
+    long long frameSamples = 0;
+    // Ray segments (scene queries) traced this frame
+    long long frameRays = 0;
+    // Acceleration structure: build figures and this frame's traversal work
+    AccelStats accel;
+    TraversalCounters traversal;
+    int convergedPixels = 0;
+    int tileSize = 0;
+    int tiles = 0;
+    int steals = 0;
+    double idleMs = 0.0;
+};
+
+// What the 8-bit output shows
+enum class DebugView {
+    None,
+    // accumulated samples per pixel, black (none) to white (the most of any pixel)
+    SampleCount
+};
+
+// How paths are traced
+enum class Integrator {
+    // each path to its end before the next one starts
+    DepthFirst,
+    // Ray streams: the paths of a tile advance one bounce at a time, all
+    // intersections first, then the shading grouped by material
+    Wavefront
+};
+
+// Lets another thread abort a render in progress
+class CancelToken {
+public:
+    CancelToken() : flag(false) {}
+    void cancel() { flag = true; }
+    void reset() { flag = false; }
+    bool cancelled() const { return flag; }
+
+private:
+    std::atomic<bool> flag;
+};
+
+struct RenderOptions {
+    // No tile is started after this point
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Checked before every tile; may be null
+    const CancelToken* cancel = nullptr;
+    // Receives the fraction of this frame's tiles finished after each tile.
+    // Calls are serialized but come from the render workers.
+    std::function<void(float)> progress;
+};
+
+struct RenderResult {
+    // false if the deadline or the cancel token stopped the frame early
+    bool complete = true;
+    bool cancelled = false;
+    int tilesDone = 0;
+    int tilesTotal = 0;
+    long long samples = 0;
+};
 
 class Renderer {
 public:
-    Renderer(int width, int height, int samplesPerPixel, int maxDepth);
+    // numThreads <= 0 uses one render thread per hardware thread
+    Renderer(int width, int height, int samplesPerPixel, int maxDepth, int numThreads = 0);
     void setScene(const hittableList& world, const Camera& camera);
+    // Call after moving or resizing objects of the scene in place: updates the
+    // acceleration structure and restarts accumulation. Without an index every
+    // object is checked for its dirty flag.
+    void geometryChanged();
+    void geometryChanged(int objectIndex);
+    void setAccelerator(Accelerator kind);
+    Accelerator getAccelerator() const { return accelKind; }
+    // How BVH and BVH4 are built; the linear builders use the render threads
+    void setBvhBuilder(BvhBuilder builder);
+    BvhBuilder getBvhBuilder() const { return bvhBuilder; }
     void renderScene();
+    // Renders as many tiles as fit before the deadline or a cancellation and
+    // accumulates their samples. Tiles that were left out are rendered
+    // first on the next call, so a budget that is always too small still
+    // covers the whole image over a few frames.
+    RenderResult renderScene(const RenderOptions& options);
     const std::vector<unsigned char>& getPixels() const;
+    // Restarts accumulation only if the camera actually moved
     void updateCamera(const Camera &cam);
+    // Call after editing objects or materials of the scene in place
+    void resetAccumulation() { accumulationValid = false; }
+    // The scene's materials, shared with the table setScene was given
+    const materialTable& getMaterials() const { return world.get_materials(); }
+
+    // With a fixed seed a frame is identical whatever the thread count
+    void setSeed(uint32_t s) { seed = s; frameIndex = 0; resetAccumulation(); }
+    int getThreadCount() const { return pool.size(); }
+
+    // Dynamic resolution: while a budget is set the internal resolution is
+    // scaled so renderScene takes about targetMs, and the result is upscaled
+    // to the full output size. targetMs <= 0 renders at full resolution.
+    void setTargetFrameTime(double targetMs);
+    double getTargetFrameTime() const { return targetFrameMs; }
+
+    // Adaptive sampling: once a pixel has minSamples, it stops receiving new
+    // ones when the standard error of its mean luminance falls below
+    // threshold times that mean
+    void setAdaptiveSampling(bool enabled, float threshold = 0.02f, int minSamples = 16);
+    bool getAdaptiveSampling() const { return adaptive; }
+    void setDebugView(DebugView view) { debugView = view; }
+
+    // Russian roulette: from bounce minBounces on, a path survives with a
+    // probability equal to its largest throughput component (capped at 0.95)
+    // and is reweighted by the inverse, so the image stays unbiased
+    void setRussianRoulette(bool enabled, int minBounces = 3);
+    bool getRussianRoulette() const { return roulette; }
+
+    // Both integrators give the same image for the same seed
+    void setIntegrator(Integrator mode);
+    Integrator getIntegrator() const { return integrator; }
+
+    // Packet tracing: the camera rays of each 4x4 pixel block (16 at a time
+    // in the wavefront integrator) are traced together through the
+    // accelerator, after which every path continues on its own. Has no
+    // effect with the List accelerator.
+    void setPacketTracing(bool enabled);
+    bool getPacketTracing() const { return packets; }
+    const RenderStats& getStats() const { return stats; }
 
 private:
+    // Tile edge length in pixels adapts between these bounds to keep each tile
+    // within the target time window
+    static const int MIN_TILE_SIZE = 8;
+    static const int MAX_TILE_SIZE = 64;
+    static constexpr double MIN_TILE_MS = 0.5;
+    static constexpr double MAX_TILE_MS = 4.0;
+    // Lowest fraction of the output width/height rendered under a frame budget
+    static constexpr float MIN_RENDER_SCALE = 0.25f;
+    // Edge length of the pixel blocks traced as one packet
+    static const int PACKET_SIZE = 4;
+    // Most paths the wavefront integrator keeps in flight per render thread
+    static const int WAVEFRONT_BATCH = 16384;
+
+    struct Tile {
+        int x0, y0, x1, y1;
+        // times the tile was rendered since accumulation started
+        int passes;
+    };
+
     int imgWidth, imgHeight, spp, maxDepth;
     Camera camera;
     hittableList world;
+    // What rays are traced against: world itself or an accelerator built over it
+    shared_ptr<hittable> scene;
+    // the same structure as scene unless that is world itself, for refits
+    shared_ptr<accelStructure> accel;
+    Accelerator accelKind;
+    BvhBuilder bvhBuilder;
+    AccelStats accelStats;
     std::vector<unsigned char> pixels;
+    // Internal resolution; below full size frames go to lowResPixels first
+    int renderWidth, renderHeight;
+    float renderScale;
+    double targetFrameMs;
+    std::vector<unsigned char> lowResPixels;
+    // Running sums of linear radiance and their per-pixel sample counts;
+    // pixels holds the tonemapped average
+    std::vector<float> accumulation;
+    std::vector<int> sampleCount;
+    bool accumulationValid;
+    int accumulatedSamples;
+    // Per-pixel sum of squared sample luminance, for the variance estimate
+    std::vector<float> luminanceSq;
+    bool adaptive;
+    float noiseThreshold;
+    int minAdaptiveSamples;
+    DebugView debugView;
+    std::atomic<long long> frameSamples;
+    std::atomic<long long> frameRays;
+    std::atomic<int> convergedPixels;
+    std::atomic<long long> traversalRays, traversalNodes, traversalPrims;
+    bool roulette;
+    int rouletteMinBounces;
+    bool packets;
+    Integrator integrator;
+    ThreadPool pool;
+    uint32_t seed;
+    uint32_t frameIndex;
+    int tileSize;
+    std::vector<Tile> tiles;
+    std::vector<int> tileOrder;
+    std::mutex progressMtx;
+    RenderStats stats;
 
-    color ray_color(const ray& r, hittableList world, int depth);
+    void buildAccelerator();
+    void refitAccelerator(const std::vector<int>& objectIndices);
+    void setRenderScale(float scale);
+    void adaptRenderScale(double frameMs);
+    void upscale();
+    void downscale();
+    void buildTiles();
+    void adaptTileSize(double tileMs);
+    void renderTile(const Tile& tile);
+    // Add the tile's samples to the accumulation buffers and count the
+    // samples, ray segments and converged pixels
+    void traceDepthFirst(const Tile& tile, uint64_t frameSeed, long long& samples, long long& rays,
+                         int& convergedCount);
+    void traceWavefront(const Tile& tile, uint64_t frameSeed, long long& samples, long long& rays,
+                        int& convergedCount);
+    bool converged(int pixel) const;
+    // Adds the number of segments traced to rays. primary, if given, is the
+    // first hit of r, already traced, and primaryHit whether there was one.
+    color ray_color(const ray& r, const hittable& world, int depth, pcg32& rng, long long& rays,
+                    const hit_record* primary = nullptr, bool primaryHit = false) const;
     // Other private methods and members...
 };
 
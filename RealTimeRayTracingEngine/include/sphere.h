@@ -3,28 +3,94 @@
 
 #include "hittable.h"
 #include "vec3.h"
+#include "materialTable.h"
 
 class sphere: public hittable
 {
 private:
     point3 center;
     float radius;
-    shared_ptr<material> mat_ptr;
+    uint32_t mat_id;
+    // set by anything that moves or resizes the sphere
+    bool dirty;
 public:
-    sphere(){}
-    sphere(point3 cen, float r, shared_ptr<material> mat): center(cen), radius(r), mat_ptr(mat){}
+    sphere(): hittable(HittableKind::Sphere), radius(0), mat_id(materialTable::NONE), dirty(false){}
+    sphere(point3 cen, float r, uint32_t mat)
+        : hittable(HittableKind::Sphere), center(cen), radius(r), mat_id(mat), dirty(false){}
     
     point3 get_center() const {return center;}
     float get_radius() const {return radius;}
-    shared_ptr<material> get_material() const {return mat_ptr;}
+    uint32_t get_material() const {return mat_id;}
 
-    void set_center(point3 cen){center = cen;}
-    void set_radius(float r){radius = r;}
-    void set_material(shared_ptr<material> mat){mat_ptr = mat;}
+    void set_center(point3 cen){center = cen; dirty = true;}
+    void set_radius(float r){radius = r; dirty = true;}
+    void set_material(uint32_t mat){mat_id = mat;}
 
     virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual void fill_record(const ray& r, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+    virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool is_dirty() const override {return dirty;}
+    virtual void clear_dirty() override {dirty = false;}
 
+};
 
+// Defined here so the closed-set dispatch can inline them
+inline bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (!sphere::intersect(r, t_min, t_max, rec))
+        return false;
+    rec.object = nullptr;
+    sphere::fill_record(r, rec);
+    return true;
+}
+
+inline bool sphere::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius*radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    // Find the nearest root that lies in the acceptable range.
+    auto root = (-half_b - sqrtd) / a;
+    if (root < t_min || t_max < root) {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+            return false;
+    }
+
+    rec.t = root;
+    rec.object = this;
+    return true;
+}
+
+inline void sphere::fill_record(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_id = mat_id;
+}
+
+inline bool sphere::occluded(const ray& r, float t_min, float t_max) const {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius*radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    // either root in range will do
+    auto root = (-half_b - sqrtd) / a;
+    if (root >= t_min && root <= t_max)
+        return true;
+    root = (-half_b + sqrtd) / a;
+    return root >= t_min && root <= t_max;
+}
 
-};
 #endif
@@ -0,0 +1,45 @@
+#ifndef SPHERE_KERNEL_H
+#define SPHERE_KERNEL_H
+
+#include <cstdint>
+
+// What sphereStore's batch kernels see: plain arrays and floats, so nothing
+// built for one instruction set is shared with code built for another
+
+// the store's component arrays
+struct sphereArrays {
+    const float* cx;
+    const float* cy;
+    const float* cz;
+    const float* r2;
+};
+
+// a ray; a is the squared length of its direction
+struct sphereRay {
+    float ox, oy, oz;
+    float dx, dy, dz;
+    float a;
+};
+
+// Index of the sphere among begin to end - 1 with the nearest hit between
+// t_min and closest, which is lowered to its distance; -1 if none is hit
+typedef int (*sphereNearestFn)(const sphereArrays& s, const sphereRay& r, int begin, int end, float t_min,
+                               float& closest);
+// Index of a sphere among begin to end - 1 hit between t_min and t_max, from
+// the first batch that has one; -1 if none is hit
+typedef int (*sphereAnyFn)(const sphereArrays& s, const sphereRay& r, int begin, int end, float t_min,
+                           float t_max);
+
+// One pair of kernels per instruction set, each defined in its own
+// translation unit compiled for that set. Null where the compiler could not
+// build them.
+sphereNearestFn sphere_nearest_sse2();
+sphereNearestFn sphere_nearest_sse42();
+sphereNearestFn sphere_nearest_avx2();
+sphereNearestFn sphere_nearest_avx512();
+sphereAnyFn sphere_any_sse2();
+sphereAnyFn sphere_any_sse42();
+sphereAnyFn sphere_any_avx2();
+sphereAnyFn sphere_any_avx512();
+
+#endif
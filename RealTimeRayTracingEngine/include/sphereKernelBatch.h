@@ -0,0 +1,245 @@
+#ifndef SPHERE_KERNEL_BATCH_H
+#define SPHERE_KERNEL_BATCH_H
+
+// The batch sphere test, written once over a lane width. Only the kernel
+// translation units include this; everything here has internal linkage so
+// each gets its own copy built for its instruction set.
+
+#include "sphereKernel.h"
+#include "vec3xN.h"
+
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+namespace {
+
+// Lane operations of each width. Masks select lanes: a vector of all-ones
+// and all-zeros lanes up to AVX2, a bit mask with AVX-512.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+struct lanes4 {
+    static const int WIDTH = 4;
+    typedef vec3x4 vec;
+    typedef __m128 real;
+    typedef __m128 mask;
+    typedef __m128i index;
+
+    SIMD_INLINE static real set1(float v) { return _mm_set1_ps(v); }
+    SIMD_INLINE static real load(const float* p) { return _mm_loadu_ps(p); }
+    SIMD_INLINE static real add(real a, real b) { return _mm_add_ps(a, b); }
+    SIMD_INLINE static real sub(real a, real b) { return _mm_sub_ps(a, b); }
+    SIMD_INLINE static real mul(real a, real b) { return _mm_mul_ps(a, b); }
+    SIMD_INLINE static real div(real a, real b) { return _mm_div_ps(a, b); }
+    SIMD_INLINE static real sqrt(real a) { return _mm_sqrt_ps(a); }
+    SIMD_INLINE static real neg(real a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+    SIMD_INLINE static mask ge(real a, real b) { return _mm_cmpge_ps(a, b); }
+    SIMD_INLINE static mask le(real a, real b) { return _mm_cmple_ps(a, b); }
+    SIMD_INLINE static mask both(mask a, mask b) { return _mm_and_ps(a, b); }
+    SIMD_INLINE static mask either(mask a, mask b) { return _mm_or_ps(a, b); }
+    SIMD_INLINE static bool any(mask m) { return _mm_movemask_ps(m) != 0; }
+    // a bit per lane
+    SIMD_INLINE static int bits(mask m) { return _mm_movemask_ps(m); }
+    // a where m is set, b elsewhere
+    SIMD_INLINE static real select(mask m, real a, real b) {
+#ifdef __SSE4_1__
+        return _mm_blendv_ps(b, a, m);
+#else
+        return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+#endif
+    }
+    SIMD_INLINE static index iset1(int v) { return _mm_set1_epi32(v); }
+    // first, first + 1, ...
+    SIMD_INLINE static index iota(int first) { return _mm_add_epi32(_mm_set1_epi32(first), _mm_setr_epi32(0, 1, 2, 3)); }
+    SIMD_INLINE static mask below(index i, int end) { return _mm_castsi128_ps(_mm_cmplt_epi32(i, _mm_set1_epi32(end))); }
+    SIMD_INLINE static index iselect(mask m, index a, index b) {
+        return _mm_castps_si128(select(m, _mm_castsi128_ps(a), _mm_castsi128_ps(b)));
+    }
+    SIMD_INLINE static void store(float* p, real v) { _mm_storeu_ps(p, v); }
+    SIMD_INLINE static void istore(int32_t* p, index v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+};
+#endif
+
+#if defined(__AVX2__)
+struct lanes8 {
+    static const int WIDTH = 8;
+    typedef vec3x8 vec;
+    typedef __m256 real;
+    typedef __m256 mask;
+    typedef __m256i index;
+
+    SIMD_INLINE static real set1(float v) { return _mm256_set1_ps(v); }
+    SIMD_INLINE static real load(const float* p) { return _mm256_loadu_ps(p); }
+    SIMD_INLINE static real add(real a, real b) { return _mm256_add_ps(a, b); }
+    SIMD_INLINE static real sub(real a, real b) { return _mm256_sub_ps(a, b); }
+    SIMD_INLINE static real mul(real a, real b) { return _mm256_mul_ps(a, b); }
+    SIMD_INLINE static real div(real a, real b) { return _mm256_div_ps(a, b); }
+    SIMD_INLINE static real sqrt(real a) { return _mm256_sqrt_ps(a); }
+    SIMD_INLINE static real neg(real a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+    SIMD_INLINE static mask ge(real a, real b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    SIMD_INLINE static mask le(real a, real b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    SIMD_INLINE static mask both(mask a, mask b) { return _mm256_and_ps(a, b); }
+    SIMD_INLINE static mask either(mask a, mask b) { return _mm256_or_ps(a, b); }
+    SIMD_INLINE static bool any(mask m) { return _mm256_movemask_ps(m) != 0; }
+    SIMD_INLINE static int bits(mask m) { return _mm256_movemask_ps(m); }
+    SIMD_INLINE static real select(mask m, real a, real b) { return _mm256_blendv_ps(b, a, m); }
+    SIMD_INLINE static index iset1(int v) { return _mm256_set1_epi32(v); }
+    SIMD_INLINE static index iota(int first) {
+        return _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    }
+    SIMD_INLINE static mask below(index i, int end) {
+        return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(end), i));
+    }
+    SIMD_INLINE static index iselect(mask m, index a, index b) {
+        return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), m));
+    }
+    SIMD_INLINE static void store(float* p, real v) { _mm256_storeu_ps(p, v); }
+    SIMD_INLINE static void istore(int32_t* p, index v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+};
+#endif
+
+#if defined(__AVX512F__)
+struct lanes16 {
+    static const int WIDTH = 16;
+    typedef vec3x16 vec;
+    typedef __m512 real;
+    typedef __mmask16 mask;
+    typedef __m512i index;
+
+    SIMD_INLINE static real set1(float v) { return _mm512_set1_ps(v); }
+    SIMD_INLINE static real load(const float* p) { return _mm512_loadu_ps(p); }
+    SIMD_INLINE static real add(real a, real b) { return _mm512_add_ps(a, b); }
+    SIMD_INLINE static real sub(real a, real b) { return _mm512_sub_ps(a, b); }
+    SIMD_INLINE static real mul(real a, real b) { return _mm512_mul_ps(a, b); }
+    SIMD_INLINE static real div(real a, real b) { return _mm512_div_ps(a, b); }
+    // _mm512_sqrt_ps passes an undefined vector through as the masked-off
+    // source, which GCC warns may be uninitialized; a zero mask source with
+    // every lane set is the same instruction
+    SIMD_INLINE static real sqrt(real a) { return _mm512_maskz_sqrt_ps(0xFFFF, a); }
+    // AVX-512F has no float xor; flip the sign bits as integers
+    SIMD_INLINE static real neg(real a) {
+        return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(INT32_MIN)));
+    }
+    SIMD_INLINE static mask ge(real a, real b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+    SIMD_INLINE static mask le(real a, real b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+    SIMD_INLINE static mask both(mask a, mask b) { return a & b; }
+    SIMD_INLINE static mask either(mask a, mask b) { return a | b; }
+    SIMD_INLINE static bool any(mask m) { return m != 0; }
+    SIMD_INLINE static int bits(mask m) { return m; }
+    SIMD_INLINE static real select(mask m, real a, real b) { return _mm512_mask_blend_ps(m, b, a); }
+    SIMD_INLINE static index iset1(int v) { return _mm512_set1_epi32(v); }
+    SIMD_INLINE static index iota(int first) {
+        return _mm512_add_epi32(_mm512_set1_epi32(first),
+                                _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    }
+    SIMD_INLINE static mask below(index i, int end) { return _mm512_cmplt_epi32_mask(i, _mm512_set1_epi32(end)); }
+    SIMD_INLINE static index iselect(mask m, index a, index b) { return _mm512_mask_blend_epi32(m, b, a); }
+    SIMD_INLINE static void store(float* p, real v) { _mm512_storeu_ps(p, v); }
+    SIMD_INLINE static void istore(int32_t* p, index v) { _mm512_storeu_si512(p, v); }
+};
+#endif
+
+// sphere::hit on WIDTH spheres at a time. Each lane keeps the nearest hit
+// among its spheres; lanes past end belong to whatever follows in the store.
+// The multiplies and adds stay separate: a fused multiply-add would round
+// differently from sphere::hit.
+template <class L>
+int nearest_batch(const sphereArrays& s, const sphereRay& r, int begin, int end, float t_min, float& closest) {
+    typedef typename L::vec vec;
+    typedef typename L::real real;
+    typedef typename L::mask mask;
+    typedef typename L::index index;
+
+    vec origin(r.ox, r.oy, r.oz);
+    vec dir(r.dx, r.dy, r.dz);
+    real a = L::set1(r.a);
+    real tMin = L::set1(t_min);
+    real zero = L::set1(0.0f);
+
+    real bestT = L::set1(closest);
+    index bestIndex = L::iset1(-1);
+    for (int i = begin; i < end; i += L::WIDTH) {
+        index lane = L::iota(i);
+        vec oc = origin - vec::load(s.cx + i, s.cy + i, s.cz + i);
+        real halfB = dot(oc, dir);
+        real c = L::sub(dot(oc, oc), L::load(s.r2 + i));
+        real discriminant = L::sub(L::mul(halfB, halfB), L::mul(a, c));
+        mask hit = L::both(L::ge(discriminant, zero), L::below(lane, end));
+        if (!L::any(hit))
+            continue;
+
+        real sqrtd = L::sqrt(discriminant);
+        real negHalfB = L::neg(halfB);
+        real rootNear = L::div(L::sub(negHalfB, sqrtd), a);
+        real rootFar = L::div(L::add(negHalfB, sqrtd), a);
+        // the near root unless it is out of range, as in sphere::hit
+        mask nearOk = L::both(L::ge(rootNear, tMin), L::le(rootNear, bestT));
+        mask farOk = L::both(L::ge(rootFar, tMin), L::le(rootFar, bestT));
+        real t = L::select(nearOk, rootNear, rootFar);
+        hit = L::both(hit, L::either(nearOk, farOk));
+
+        bestT = L::select(hit, t, bestT);
+        bestIndex = L::iselect(hit, lane, bestIndex);
+    }
+
+    float laneT[L::WIDTH];
+    int32_t laneIndex[L::WIDTH];
+    L::store(laneT, bestT);
+    L::istore(laneIndex, bestIndex);
+    // on equal distances the later sphere wins, as in a sequential loop
+    int found = -1;
+    for (int l = 0; l < L::WIDTH; l++) {
+        if (laneIndex[l] < 0)
+            continue;
+        if (found < 0 || laneT[l] < closest || (laneT[l] == closest && laneIndex[l] > found)) {
+            closest = laneT[l];
+            found = laneIndex[l];
+        }
+    }
+    return found;
+}
+
+// nearest_batch's test without keeping the nearest: any lane with a root in
+// [t_min, t_max] ends the search at its batch
+template <class L>
+int any_batch(const sphereArrays& s, const sphereRay& r, int begin, int end, float t_min, float t_max) {
+    typedef typename L::vec vec;
+    typedef typename L::real real;
+    typedef typename L::mask mask;
+
+    vec origin(r.ox, r.oy, r.oz);
+    vec dir(r.dx, r.dy, r.dz);
+    real a = L::set1(r.a);
+    real tMin = L::set1(t_min);
+    real tMax = L::set1(t_max);
+    real zero = L::set1(0.0f);
+
+    for (int i = begin; i < end; i += L::WIDTH) {
+        vec oc = origin - vec::load(s.cx + i, s.cy + i, s.cz + i);
+        real halfB = dot(oc, dir);
+        real c = L::sub(dot(oc, oc), L::load(s.r2 + i));
+        real discriminant = L::sub(L::mul(halfB, halfB), L::mul(a, c));
+        mask hit = L::both(L::ge(discriminant, zero), L::below(L::iota(i), end));
+        if (!L::any(hit))
+            continue;
+
+        real sqrtd = L::sqrt(discriminant);
+        real negHalfB = L::neg(halfB);
+        real rootNear = L::div(L::sub(negHalfB, sqrtd), a);
+        real rootFar = L::div(L::add(negHalfB, sqrtd), a);
+        mask nearOk = L::both(L::ge(rootNear, tMin), L::le(rootNear, tMax));
+        mask farOk = L::both(L::ge(rootFar, tMin), L::le(rootFar, tMax));
+        int lanes = L::bits(L::both(hit, L::either(nearOk, farOk)));
+        if (lanes == 0)
+            continue;
+        int l = 0;
+        while (!(lanes & (1 << l)))
+            l++;
+        return i + l;
+    }
+    return -1;
+}
+
+}
+
+#endif
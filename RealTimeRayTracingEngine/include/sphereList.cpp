@@ -0,0 +1,100 @@
+#include "sphereList.h"
+
+#include <chrono>
+
+sphereList::sphereList(const std::vector<shared_ptr<hittable>>& objects) : objects(objects) {
+    auto start = std::chrono::steady_clock::now();
+
+    spheres.reserve(objects.size());
+    sphereSlot.assign(objects.size(), -1);
+    for (size_t i = 0; i < objects.size(); i++) {
+        objects[i]->clear_dirty();
+        if (objects[i]->kind() == HittableKind::Sphere)
+            sphereSlot[i] = spheres.add(static_cast<const sphere&>(*objects[i]));
+        else
+            others.push_back(objects[i]);
+    }
+
+    buildStats.bytes = spheres.bytes() + objects.size() * sizeof(int) + others.size() * sizeof(shared_ptr<hittable>);
+    buildStats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool sphereList::refit(const std::vector<int>& objectIndices) {
+    auto start = std::chrono::steady_clock::now();
+    for (int index : objectIndices) {
+        if (index < 0 || index >= static_cast<int>(objects.size()))
+            continue;
+        objects[index]->clear_dirty();
+        if (sphereSlot[index] >= 0)
+            spheres.update(sphereSlot[index], static_cast<const sphere&>(*objects[index]));
+    }
+    buildStats.refits++;
+    buildStats.lastRefitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return false;
+}
+
+bool sphereList::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (!intersect(r, t_min, t_max, rec))
+        return false;
+    complete_record(r, rec);
+    return true;
+}
+
+bool sphereList::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    TraversalCounters& counters = traversal_counters();
+    counters.rays++;
+    counters.prims += objects.size();
+
+    float closest = t_max;
+    int found = spheres.nearest(r, 0, spheres.size(), t_min, closest);
+    bool hit_anything = found >= 0;
+    if (hit_anything) {
+        rec.t = closest;
+        rec.object = this;
+        rec.prim = found;
+    }
+
+    for (const auto &object : others) {
+        if (object->intersect(r, t_min, closest, rec)) {
+            hit_anything = true;
+            closest = rec.t;
+        }
+    }
+    return hit_anything;
+}
+
+void sphereList::fill_record(const ray& r, hit_record& rec) const {
+    spheres.fill_record(rec.prim, r, rec.t, rec);
+}
+
+bool sphereList::occluded(const ray& r, float t_min, float t_max) const {
+    TraversalCounters& counters = traversal_counters();
+    counters.rays++;
+
+    // the spheres up to the one found, give or take the rest of its batch
+    int found = spheres.any(r, 0, spheres.size(), t_min, t_max);
+    counters.prims += found >= 0 ? found + 1 : spheres.size();
+    if (found >= 0)
+        return true;
+    for (const auto &object : others) {
+        counters.prims++;
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
+bool sphereList::bounding_box(aabb& output_box) const {
+    if (objects.empty())
+        return false;
+
+    aabb box;
+    aabb objectBox;
+    for (const auto &object : objects) {
+        if (!object->bounding_box(objectBox))
+            return false;
+        box.grow(objectBox);
+    }
+    output_box = box;
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef SPHERE_LIST_H
+#define SPHERE_LIST_H
+
+#include "accelerator.h"
+#include "sphereStore.h"
+
+#include <memory>
+#include <vector>
+
+using std::shared_ptr;
+
+// Brute force like hittableList, but the spheres among the objects are
+// copied into a sphereStore and tested eight at a time. Other objects are
+// tested one by one after them.
+class sphereList : public accelStructure
+{
+public:
+    explicit sphereList(const std::vector<shared_ptr<hittable>>& objects);
+
+    // Copies the moved spheres into the store again
+    virtual bool refit(const std::vector<int>& objectIndices) override;
+    virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    virtual void fill_record(const ray& r, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+    virtual bool bounding_box(aabb& output_box) const override;
+
+    virtual const AccelStats& stats() const override { return buildStats; }
+
+private:
+    // the constructor's list, kept for refits
+    std::vector<shared_ptr<hittable>> objects;
+    sphereStore spheres;
+    // per object: its index in spheres, or -1 for the others
+    std::vector<int> sphereSlot;
+    std::vector<shared_ptr<hittable>> others;
+    AccelStats buildStats;
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "sphereStore.h"
+
+#include "cpuFeatures.h"
+#include "sphereKernelBatch.h"
+
+#include <atomic>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+// the SSE2 kernel needs nothing past the baseline, so it is built here
+sphereNearestFn sphere_nearest_sse2() {
+    return &nearest_batch<lanes4>;
+}
+
+sphereAnyFn sphere_any_sse2() {
+    return &any_batch<lanes4>;
+}
+
+#else
+
+sphereNearestFn sphere_nearest_sse2() {
+    return nullptr;
+}
+
+sphereAnyFn sphere_any_sse2() {
+    return nullptr;
+}
+
+#endif
+
+namespace {
+
+// The selected kernel, and for the vector ones its functions. The functions
+// are stored first, so one that reads the kernel also sees them.
+std::atomic<int> activeKernel(static_cast<int>(SphereKernel::Auto));
+std::atomic<sphereNearestFn> activeFn(nullptr);
+std::atomic<sphereAnyFn> activeAnyFn(nullptr);
+
+// null if the build or the CPU lacks the kernel
+sphereNearestFn kernel_function(SphereKernel kernel) {
+    SimdLevel cpu = cpu_simd_level();
+    switch (kernel) {
+    case SphereKernel::AVX512:
+        return cpu >= SimdLevel::AVX512 ? sphere_nearest_avx512() : nullptr;
+    case SphereKernel::AVX2:
+        return cpu >= SimdLevel::AVX2 ? sphere_nearest_avx2() : nullptr;
+    case SphereKernel::SSE42:
+        return cpu >= SimdLevel::SSE42 ? sphere_nearest_sse42() : nullptr;
+    case SphereKernel::SSE:
+        return cpu >= SimdLevel::SSE2 ? sphere_nearest_sse2() : nullptr;
+    default:
+        return nullptr;
+    }
+}
+
+// its any-hit counterpart, for a kernel kernel_function accepted
+sphereAnyFn any_function(SphereKernel kernel) {
+    switch (kernel) {
+    case SphereKernel::AVX512: return sphere_any_avx512();
+    case SphereKernel::AVX2: return sphere_any_avx2();
+    case SphereKernel::SSE42: return sphere_any_sse42();
+    case SphereKernel::SSE: return sphere_any_sse2();
+    default: return nullptr;
+    }
+}
+
+}
+
+void sphereStore::clear() {
+    cx.clear();
+    cy.clear();
+    cz.clear();
+    r2.clear();
+    radius.clear();
+    materialId.clear();
+    count = 0;
+}
+
+void sphereStore::reserve(size_t n) {
+    cx.reserve(n + LANES);
+    cy.reserve(n + LANES);
+    cz.reserve(n + LANES);
+    r2.reserve(n + LANES);
+    radius.reserve(n);
+    materialId.reserve(n);
+}
+
+int sphereStore::add(const sphere& s) {
+    if (cx.empty())
+        pad();
+
+    // the new sphere takes the first padding lane, and a new one goes to the end
+    point3 center = s.get_center();
+    float rad = s.get_radius();
+    cx[count] = center.x();
+    cy[count] = center.y();
+    cz[count] = center.z();
+    r2[count] = rad * rad;
+    radius.push_back(rad);
+    materialId.push_back(s.get_material());
+    count++;
+    pad();
+    return count - 1;
+}
+
+void sphereStore::update(int index, const sphere& s) {
+    point3 center = s.get_center();
+    float rad = s.get_radius();
+    cx[index] = center.x();
+    cy[index] = center.y();
+    cz[index] = center.z();
+    r2[index] = rad * rad;
+    radius[index] = rad;
+    materialId[index] = s.get_material();
+}
+
+// Keeps LANES lanes past the last sphere. A squared radius of -infinity
+// makes the discriminant -infinity, so they never hit.
+void sphereStore::pad() {
+    size_t lanes = static_cast<size_t>(count) + LANES;
+    cx.resize(lanes, 0.0f);
+    cy.resize(lanes, 0.0f);
+    cz.resize(lanes, 0.0f);
+    r2.resize(lanes, -infinity);
+}
+
+size_t sphereStore::bytes() const {
+    return (cx.size() + cy.size() + cz.size() + r2.size() + radius.size()) * sizeof(float)
+        + materialId.size() * sizeof(uint32_t);
+}
+
+void sphereStore::fill_record(int index, const ray& r, float t, hit_record& rec) const {
+    point3 center(cx[index], cy[index], cz[index]);
+    rec.t = t;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius[index];
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_id = materialId[index];
+}
+
+int sphereStore::nearest(const ray& r, int begin, int end, float t_min, float& closest) const {
+    // SAH leaves mostly hold one or two spheres, too few to pay for setting
+    // up the vector registers and reducing the lanes
+    if (end - begin < MIN_BATCH)
+        return nearestScalar(r, begin, end, t_min, closest);
+
+    SphereKernel kernel = static_cast<SphereKernel>(activeKernel.load(std::memory_order_acquire));
+    if (kernel == SphereKernel::Auto) {
+        select_kernel(SphereKernel::Auto);
+        return nearest(r, begin, end, t_min, closest);
+    }
+    if (kernel == SphereKernel::Scalar)
+        return nearestScalar(r, begin, end, t_min, closest);
+
+    sphereArrays arrays = { cx.data(), cy.data(), cz.data(), r2.data() };
+    vec3 origin = r.origin();
+    vec3 dir = r.direction();
+    sphereRay batchRay = { origin.x(), origin.y(), origin.z(), dir.x(), dir.y(), dir.z(), dir.length_squared() };
+    return activeFn.load(std::memory_order_relaxed)(arrays, batchRay, begin, end, t_min, closest);
+}
+
+int sphereStore::any(const ray& r, int begin, int end, float t_min, float t_max) const {
+    if (end - begin < MIN_BATCH)
+        return anyScalar(r, begin, end, t_min, t_max);
+
+    SphereKernel kernel = static_cast<SphereKernel>(activeKernel.load(std::memory_order_acquire));
+    if (kernel == SphereKernel::Auto) {
+        select_kernel(SphereKernel::Auto);
+        return any(r, begin, end, t_min, t_max);
+    }
+    if (kernel == SphereKernel::Scalar)
+        return anyScalar(r, begin, end, t_min, t_max);
+
+    sphereArrays arrays = { cx.data(), cy.data(), cz.data(), r2.data() };
+    vec3 origin = r.origin();
+    vec3 dir = r.direction();
+    sphereRay batchRay = { origin.x(), origin.y(), origin.z(), dir.x(), dir.y(), dir.z(), dir.length_squared() };
+    return activeAnyFn.load(std::memory_order_relaxed)(arrays, batchRay, begin, end, t_min, t_max);
+}
+
+SphereKernel sphereStore::select_kernel(SphereKernel kernel) {
+    // widest first
+    const SphereKernel order[] = { SphereKernel::AVX512, SphereKernel::AVX2, SphereKernel::SSE42, SphereKernel::SSE };
+    int first = 0;
+    while (kernel != SphereKernel::Auto && first < 4 && order[first] != kernel)
+        first++;
+
+    SphereKernel chosen = SphereKernel::Scalar;
+    sphereNearestFn fn = nullptr;
+    for (int i = first; i < 4 && !fn; i++) {
+        fn = kernel_function(order[i]);
+        if (fn)
+            chosen = order[i];
+    }
+    activeFn.store(fn, std::memory_order_relaxed);
+    activeAnyFn.store(any_function(chosen), std::memory_order_relaxed);
+    activeKernel.store(static_cast<int>(chosen), std::memory_order_release);
+    return chosen;
+}
+
+SphereKernel sphereStore::active_kernel() {
+    SphereKernel kernel = static_cast<SphereKernel>(activeKernel.load());
+    return kernel == SphereKernel::Auto ? select_kernel(kernel) : kernel;
+}
+
+// sphere::hit, one sphere at a time
+int sphereStore::nearestScalar(const ray& r, int begin, int end, float t_min, float& closest) const {
+    vec3 origin = r.origin();
+    vec3 dir = r.direction();
+    float a = dir.length_squared();
+    int found = -1;
+    for (int i = begin; i < end; i++) {
+        vec3 oc = origin - point3(cx[i], cy[i], cz[i]);
+        float half_b = dot(oc, dir);
+        float c = oc.length_squared() - r2[i];
+        float discriminant = half_b*half_b - a*c;
+        if (discriminant < 0)
+            continue;
+        float sqrtd = std::sqrt(discriminant);
+
+        float root = (-half_b - sqrtd) / a;
+        if (root < t_min || closest < root) {
+            root = (-half_b + sqrtd) / a;
+            if (root < t_min || closest < root)
+                continue;
+        }
+        closest = root;
+        found = i;
+    }
+    return found;
+}
+
+int sphereStore::anyScalar(const ray& r, int begin, int end, float t_min, float t_max) const {
+    for (int i = begin; i < end; i++) {
+        float closest = t_max;
+        if (nearestScalar(r, i, i + 1, t_min, closest) >= 0)
+            return i;
+    }
+    return -1;
+}
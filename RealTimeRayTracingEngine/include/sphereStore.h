@@ -0,0 +1,84 @@
+#ifndef SPHERE_STORE_H
+#define SPHERE_STORE_H
+
+#include "sphere.h"
+#include "alignedAllocator.h"
+
+#include <cstdint>
+#include <vector>
+
+// Which implementation of the batch sphere test runs
+enum class SphereKernel {
+    // the widest the CPU supports
+    Auto,
+    Scalar,
+    // four spheres per instruction, any x86-64 CPU
+    SSE,
+    // four, with SSE4 blends
+    SSE42,
+    // eight spheres per instruction
+    AVX2,
+    // sixteen
+    AVX512
+};
+
+// Spheres as flat arrays, one per component, so a ray is tested against
+// several of them with each SIMD instruction and the nearest hit is picked
+// without leaving the registers.
+//
+// Every kernel does the same float operations in the same order as
+// sphere::hit, so both find the same hits.
+class sphereStore
+{
+public:
+    // spheres per AVX-512 batch, the widest; the arrays are padded by as
+    // many lanes that never hit, so a batch may read past the last sphere
+    static const int LANES = 16;
+    // shorter ranges are tested with the scalar kernel whatever is selected
+    static const int MIN_BATCH = 3;
+
+    void clear();
+    void reserve(size_t count);
+    // Appends a copy of s and returns its index
+    int add(const sphere& s);
+    // Copies the center, radius and material of s into slot index again
+    void update(int index, const sphere& s);
+    int size() const { return count; }
+    size_t bytes() const;
+
+    // Index of the sphere among begin to end - 1 with the nearest hit of r
+    // between t_min and closest, which is lowered to its distance; -1 if
+    // none is hit
+    int nearest(const ray& r, int begin, int end, float t_min, float& closest) const;
+    // Index of a sphere among begin to end - 1 that r hits between t_min and
+    // t_max, -1 if none is. The spheres are tested a batch at a time and the
+    // first batch with a hit ends the search, so it is not necessarily the
+    // nearest. For shadow rays.
+    int any(const ray& r, int begin, int end, float t_min, float t_max) const;
+    // The hit record of r hitting sphere index at distance t
+    void fill_record(int index, const ray& r, float t, hit_record& rec) const;
+
+    // Kernel every store uses from now on. Returns the one actually chosen:
+    // Auto resolves to a concrete kernel, and one the CPU or the build does
+    // not support falls back to the next narrower.
+    static SphereKernel select_kernel(SphereKernel kernel);
+    static SphereKernel active_kernel();
+
+private:
+    typedef std::vector<float, aligned_allocator<float, 64>> floatArray;
+
+    floatArray cx, cy, cz;
+    // squared radius, as the test needs it, and the radius for normals
+    floatArray r2;
+    std::vector<float> radius;
+    std::vector<uint32_t> materialId;
+    int count = 0;
+
+    void pad();
+
+    // sphere::hit itself; the others are in sphereKernel.h
+    int nearestScalar(const ray& r, int begin, int end, float t_min, float& closest) const;
+    int anyScalar(const ray& r, int begin, int end, float t_min, float t_max) const;
+};
+
+#endif
@@ -0,0 +1,27 @@
+// The AVX2 sphere kernel. Only the sphereStore*.cpp kernel files are compiled
+// with wider instruction sets, and sphereStore only calls into them after
+// checking the CPU supports them.
+
+#include "sphereKernelBatch.h"
+
+#if defined(__AVX2__)
+
+sphereNearestFn sphere_nearest_avx2() {
+    return &nearest_batch<lanes8>;
+}
+
+sphereAnyFn sphere_any_avx2() {
+    return &any_batch<lanes8>;
+}
+
+#else
+
+sphereNearestFn sphere_nearest_avx2() {
+    return nullptr;
+}
+
+sphereAnyFn sphere_any_avx2() {
+    return nullptr;
+}
+
+#endif
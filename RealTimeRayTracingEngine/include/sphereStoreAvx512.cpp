@@ -0,0 +1,25 @@
+// The AVX-512 sphere kernel, sixteen spheres per instruction
+
+#include "sphereKernelBatch.h"
+
+#if defined(__AVX512F__)
+
+sphereNearestFn sphere_nearest_avx512() {
+    return &nearest_batch<lanes16>;
+}
+
+sphereAnyFn sphere_any_avx512() {
+    return &any_batch<lanes16>;
+}
+
+#else
+
+sphereNearestFn sphere_nearest_avx512() {
+    return nullptr;
+}
+
+sphereAnyFn sphere_any_avx512() {
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,26 @@
+// The SSE4 sphere kernel: four lanes like the SSE2 one, with blends for the
+// lane selects. MSVC has no switch for SSE4 alone, so it builds the stub.
+
+#include "sphereKernelBatch.h"
+
+#if defined(__SSE4_2__)
+
+sphereNearestFn sphere_nearest_sse42() {
+    return &nearest_batch<lanes4>;
+}
+
+sphereAnyFn sphere_any_sse42() {
+    return &any_batch<lanes4>;
+}
+
+#else
+
+sphereNearestFn sphere_nearest_sse42() {
+    return nullptr;
+}
+
+sphereAnyFn sphere_any_sse42() {
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,139 @@
+#include "threadPool.h"
+
+#include <chrono>
+
+static double nowMs() {
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ThreadPool::ThreadPool(int numThreads)
+    : job(nullptr), steals(0), busyWorkers(0), generation(0), stopping(false) {
+    if (numThreads <= 0)
+        numThreads = static_cast<int>(std::thread::hardware_concurrency());
+    if (numThreads <= 0)
+        numThreads = 1;
+
+    for (int i = 0; i < numThreads; i++)
+        queues.emplace_back(new WorkQueue());
+    finishTimes.resize(numThreads);
+
+    // thread 0 is whoever calls parallelFor
+    for (int i = 1; i < numThreads; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    wakeCond.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& task) {
+    stats = SchedulerStats();
+    stats.tasks = count;
+    if (count <= 0)
+        return;
+
+    if (workers.empty()) {
+        for (int i = 0; i < count; i++)
+            task(i);
+        return;
+    }
+
+    int n = size();
+    for (int q = 0; q < n; q++)
+        queues[q]->items.clear();
+    for (int i = 0; i < count; i++)
+        queues[i % n]->items.push_back(i);
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        job = &task;
+        steals = 0;
+        busyWorkers = static_cast<int>(workers.size());
+        generation++;
+    }
+    wakeCond.notify_all();
+
+    runJob(0);
+
+    // the job must stay alive until every worker has let go of it
+    std::unique_lock<std::mutex> lock(mtx);
+    doneCond.wait(lock, [this]{ return busyWorkers == 0; });
+    job = nullptr;
+
+    double end = nowMs();
+    for (int t = 0; t < n; t++)
+        stats.idleMs += end - finishTimes[t];
+    stats.steals = steals;
+}
+
+bool ThreadPool::popLocal(int id, int& item) {
+    WorkQueue& q = *queues[id];
+    std::lock_guard<std::mutex> lock(q.mtx);
+    if (q.items.empty())
+        return false;
+    item = q.items.front();
+    q.items.pop_front();
+    return true;
+}
+
+bool ThreadPool::steal(int id, int& item) {
+    while (true) {
+        // the fullest deque is the one most likely to leave a thread running late
+        int victim = -1;
+        size_t most = 0;
+        for (int t = 0; t < size(); t++) {
+            if (t == id)
+                continue;
+            std::lock_guard<std::mutex> lock(queues[t]->mtx);
+            if (queues[t]->items.size() > most) {
+                most = queues[t]->items.size();
+                victim = t;
+            }
+        }
+        if (victim < 0)
+            return false;
+
+        WorkQueue& q = *queues[victim];
+        std::lock_guard<std::mutex> lock(q.mtx);
+        if (q.items.empty())
+            continue;
+        item = q.items.back();
+        q.items.pop_back();
+        steals++;
+        return true;
+    }
+}
+
+void ThreadPool::runJob(int id) {
+    int item;
+    while (popLocal(id, item) || steal(id, item))
+        (*job)(item);
+    // nothing is ever pushed during a job, so once every deque is empty this thread is done
+    finishTimes[id] = nowMs();
+}
+
+void ThreadPool::workerLoop(int id) {
+    unsigned long seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            wakeCond.wait(lock, [&]{ return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+
+        runJob(id);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (--busyWorkers == 0)
+            doneCond.notify_one();
+    }
+}
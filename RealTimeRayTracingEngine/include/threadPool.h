@@ -0,0 +1,70 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Load-balancing counters of the most recent parallelFor
+struct SchedulerStats {
+    int tasks = 0;
+    int steals = 0;
+    // summed over all threads: time spent without work while the job was still running
+    double idleMs = 0.0;
+};
+
+// Fixed set of worker threads that is created once and reused for every job.
+// The calling thread takes part in each job, so a pool of size 1 runs
+// everything inline without spawning any threads.
+//
+// Work is dealt round-robin into one deque per thread. A thread pops from the
+// front of its own deque and, once that is empty, steals from the back of the
+// fullest other deque, so the first indices of a job are worked on first.
+class ThreadPool {
+public:
+    // numThreads <= 0 picks one thread per hardware thread
+    explicit ThreadPool(int numThreads);
+    ~ThreadPool();
+
+    int size() const { return static_cast<int>(workers.size()) + 1; }
+
+    // Runs task(i) for every i in [0, count) and blocks until all of them are done
+    void parallelFor(int count, const std::function<void(int)>& task);
+
+    const SchedulerStats& lastStats() const { return stats; }
+
+private:
+    struct WorkQueue {
+        std::mutex mtx;
+        std::deque<int> items;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::mutex mtx;
+    std::condition_variable wakeCond;
+    std::condition_variable doneCond;
+
+    const std::function<void(int)>* job;
+    std::atomic<int> steals;
+    std::vector<double> finishTimes;
+    int busyWorkers;
+    unsigned long generation;
+    bool stopping;
+    SchedulerStats stats;
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    void workerLoop(int id);
+    void runJob(int id);
+    bool popLocal(int id, int& item);
+    bool steal(int id, int& item);
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "vec3.h"
+#include "aabb.h"
+
+// Affine transform, kept together with its inverse so neither ever needs a
+// general matrix inversion. Only the top three rows of the 4x4 matrices are
+// stored; the last one is always 0 0 0 1.
+class transform {
+public:
+    // identity
+    transform() {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = inv[i][j] = i == j ? 1.0f : 0.0f;
+    }
+
+    static transform translate(const vec3& offset) {
+        transform t;
+        for (int i = 0; i < 3; i++) {
+            t.m[i][3] = offset[i];
+            t.inv[i][3] = -offset[i];
+        }
+        return t;
+    }
+
+    // Components must not be zero
+    static transform scale(const vec3& factors) {
+        transform t;
+        for (int i = 0; i < 3; i++) {
+            t.m[i][i] = factors[i];
+            t.inv[i][i] = 1.0f / factors[i];
+        }
+        return t;
+    }
+
+    static transform scale(float factor) {
+        return scale(vec3(factor, factor, factor));
+    }
+
+    // Counterclockwise about the y axis, looking down from +y
+    static transform rotate_y(float degrees) {
+        float radians = degrees_to_radians(degrees);
+        float c = std::cos(radians), s = std::sin(radians);
+        transform t;
+        t.m[0][0] = c;  t.m[0][2] = s;
+        t.m[2][0] = -s; t.m[2][2] = c;
+        // a rotation's inverse is its transpose
+        t.inv[0][0] = c; t.inv[0][2] = -s;
+        t.inv[2][0] = s; t.inv[2][2] = c;
+        return t;
+    }
+
+    // Applies other first, then this
+    transform operator*(const transform& other) const {
+        transform t;
+        multiply(m, other.m, t.m);
+        multiply(other.inv, inv, t.inv);
+        return t;
+    }
+
+    transform inverse() const {
+        transform t;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++) {
+                t.m[i][j] = inv[i][j];
+                t.inv[i][j] = m[i][j];
+            }
+        return t;
+    }
+
+    point3 apply_point(const point3& p) const {
+        return apply(m, p, 1.0f);
+    }
+
+    vec3 apply_vector(const vec3& v) const {
+        return apply(m, v, 0.0f);
+    }
+
+    // Normals go through the inverse transpose to stay perpendicular to
+    // transformed surfaces; the result is not normalized
+    vec3 apply_normal(const vec3& n) const {
+        return vec3(inv[0][0] * n[0] + inv[1][0] * n[1] + inv[2][0] * n[2],
+                    inv[0][1] * n[0] + inv[1][1] * n[1] + inv[2][1] * n[2],
+                    inv[0][2] * n[0] + inv[1][2] * n[1] + inv[2][2] * n[2]);
+    }
+
+    point3 apply_inverse_point(const point3& p) const {
+        return apply(inv, p, 1.0f);
+    }
+
+    vec3 apply_inverse_vector(const vec3& v) const {
+        return apply(inv, v, 0.0f);
+    }
+
+    // Box around the transformed corners of box
+    aabb apply_box(const aabb& box) const {
+        aabb out;
+        for (int corner = 0; corner < 8; corner++) {
+            point3 p((corner & 1) ? box.maximum.x() : box.minimum.x(),
+                     (corner & 2) ? box.maximum.y() : box.minimum.y(),
+                     (corner & 4) ? box.maximum.z() : box.minimum.z());
+            out.grow(apply_point(p));
+        }
+        return out;
+    }
+
+    bool operator==(const transform& other) const {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                if (m[i][j] != other.m[i][j])
+                    return false;
+        return true;
+    }
+
+    bool operator!=(const transform& other) const {
+        return !(*this == other);
+    }
+
+private:
+    float m[3][4];
+    float inv[3][4];
+
+    static vec3 apply(const float a[3][4], const vec3& v, float w) {
+        return vec3(a[0][0] * v[0] + a[0][1] * v[1] + a[0][2] * v[2] + a[0][3] * w,
+                    a[1][0] * v[0] + a[1][1] * v[1] + a[1][2] * v[2] + a[1][3] * w,
+                    a[2][0] * v[0] + a[2][1] * v[1] + a[2][2] * v[2] + a[2][3] * w);
+    }
+
+    static void multiply(const float a[3][4], const float b[3][4], float out[3][4]) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+                if (j == 3)
+                    out[i][j] += a[i][3];
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+// Single-producer/single-consumer handoff over three slots. The producer
+// always owns one slot to write into, the consumer owns one to read from,
+// and the third is swapped between them, so neither side ever waits and the
+// consumer always sees the most recently published value.
+template <typename T>
+class TripleBuffer {
+public:
+    TripleBuffer() : writeIndex(0), readIndex(1), middle(2) {}
+
+    // Producer side
+    T& writeBuffer() { return slots[writeIndex]; }
+    void publish() {
+        writeIndex = middle.exchange(writeIndex | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // Consumer side: returns true if a newer value than the current read slot was taken
+    bool update() {
+        if (!(middle.load(std::memory_order_acquire) & FRESH))
+            return false;
+        readIndex = middle.exchange(readIndex, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+    const T& readBuffer() const { return slots[readIndex]; }
+
+private:
+    static const int INDEX_MASK = 3;
+    static const int FRESH = 4;
+
+    T slots[3];
+    int writeIndex;
+    int readIndex;
+    std::atomic<int> middle;
+
+    TripleBuffer(const TripleBuffer&);
+    TripleBuffer& operator=(const TripleBuffer&);
+};
+
+#endif
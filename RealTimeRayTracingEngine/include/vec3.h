@@ -5,20 +5,47 @@
 #include <iostream>
 #include "hitUtils.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VEC3_SSE 1
+#endif
+
 using std::sqrt;
-class vec3{
+
+// Held in one SSE register where SSE2 is available (any x86-64 CPU). The
+// arithmetic is done lane by lane in the order the scalar code uses, and
+// sums over the components add x, y and z left to right, so results are
+// bit for bit those of the plain float version.
+class alignas(16) vec3{
     public:
+#ifdef VEC3_SSE
+        union {
+            // the fourth lane is padding and never read
+            float val[4];
+            __m128 m;
+        };
+
+        // Default constructor
+        vec3() : m(_mm_setzero_ps()){}
+        vec3(float x, float y, float z): m(_mm_setr_ps(x, y, z, 0.0f)){}
+        explicit vec3(__m128 v): m(v){}
+#else
         float val[3];
 
         // Default constructor
         vec3() : val{0, 0, 0}{}
         vec3(float x, float y, float z): val{x, y, z}{}
+#endif
 
         float x() const { return val[0]; }
         float y() const { return val[1]; }
         float z() const { return val[2]; }
 
+#ifdef VEC3_SSE
+        vec3 operator-() const {return vec3(_mm_xor_ps(m, _mm_set1_ps(-0.0f)));}
+#else
         vec3 operator-() const {return vec3{-val[0], -val[1], -val[2]};}
+#endif
 
         //return the value of the i element
         float operator[](int i) const {return val[i];}
@@ -26,6 +53,22 @@ class vec3{
         //return the reference of the i element
         float& operator[](int i) {return val[i];}
 
+#ifdef VEC3_SSE
+        vec3& operator+= (const vec3& v){
+            m = _mm_add_ps(m, v.m);
+            return *this;
+        }
+
+        vec3& operator-= (const vec3& v){
+            m = _mm_sub_ps(m, v.m);
+            return *this;
+        }
+
+        vec3& operator*= (const float t){
+            m = _mm_mul_ps(m, _mm_set1_ps(t));
+            return *this;
+        }
+#else
         vec3& operator+= (const vec3& v){
             val[0] += v.val[0];
             val[1] += v.val[1];
@@ -46,25 +89,31 @@ class vec3{
             val[2] *= t;
             return *this;
         }
+#endif
 
         vec3& operator/=(const float t) {
             return *this *= 1/t;
         }
 
-        float length_squared() const {
-            return val[0]*val[0] + val[1]*val[1] + val[2]*val[2];
-        }
+        float length_squared() const;
 
         float length() const {
             return sqrt(length_squared());
         }
 
-        inline static vec3 random() {
-            return vec3(random_float(), random_float(), random_float());
+        inline static vec3 random(pcg32& rng) {
+            // each component in its own statement: argument evaluation order is unspecified
+            float x = random_float(rng);
+            float y = random_float(rng);
+            float z = random_float(rng);
+            return vec3(x, y, z);
         }
 
-        inline static vec3 random(float min, float max) {
-            return vec3(random_float(min, max), random_float(min, max), random_float(min, max));
+        inline static vec3 random(pcg32& rng, float min, float max) {
+            float x = random_float(rng, min, max);
+            float y = random_float(rng, min, max);
+            float z = random_float(rng, min, max);
+            return vec3(x, y, z);
         }
 
          bool near_zero() const {
@@ -85,6 +134,48 @@ inline std::ostream& operator<<(std::ostream& os, const vec3& v) {
     return os;
 }
 
+#ifdef VEC3_SSE
+// x + y + z of the lane products of u and v, added in that order
+inline float dot3(__m128 u, __m128 v) {
+    __m128 p = _mm_mul_ps(u, v);
+    __m128 sum = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(p, p)));
+}
+#endif
+
+inline float vec3::length_squared() const {
+#ifdef VEC3_SSE
+    return dot3(m, m);
+#else
+    return val[0]*val[0] + val[1]*val[1] + val[2]*val[2];
+#endif
+}
+
+inline bool operator==(const vec3 &u, const vec3 &v) {
+    return u.val[0] == v.val[0] && u.val[1] == v.val[1] && u.val[2] == v.val[2];
+}
+
+inline bool operator!=(const vec3 &u, const vec3 &v) {
+    return !(u == v);
+}
+
+#ifdef VEC3_SSE
+inline vec3 operator+(const vec3 &u, const vec3 &v) {
+    return vec3(_mm_add_ps(u.m, v.m));
+}
+
+inline vec3 operator-(const vec3 &u, const vec3 &v) {
+    return vec3(_mm_sub_ps(u.m, v.m));
+}
+
+inline vec3 operator*(const vec3 &u, const vec3 &v) {
+    return vec3(_mm_mul_ps(u.m, v.m));
+}
+
+inline vec3 operator*(float t, const vec3 &v) {
+    return vec3(_mm_mul_ps(_mm_set1_ps(t), v.m));
+}
+#else
 inline vec3 operator+(const vec3 &u, const vec3 &v) {
     return vec3(u.val[0] + v.val[0], u.val[1] + v.val[1], u.val[2] + v.val[2]);
 }
@@ -100,6 +191,7 @@ inline vec3 operator*(const vec3 &u, const vec3 &v) {
 inline vec3 operator*(float t, const vec3 &v) {
     return vec3(t*v.val[0], t*v.val[1], t*v.val[2]);
 }
+#endif
 
 inline vec3 operator*(const vec3 &v, float t) {
     return t * v;
@@ -110,35 +202,48 @@ inline vec3 operator/(vec3 v, float t) {
 }
 
 inline float dot(const vec3 &u, const vec3 &v) {
+#ifdef VEC3_SSE
+    return dot3(u.m, v.m);
+#else
     return u.val[0] * v.val[0]
         + u.val[1] * v.val[1]
         + u.val[2] * v.val[2];
+#endif
 }
 
 inline vec3 cross(const vec3 &u, const vec3 &v) {
+#ifdef VEC3_SSE
+    // u.yzx * v.zxy - u.zxy * v.yzx
+    __m128 uYzx = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 vZxy = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 uZxy = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 vYzx = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 0, 2, 1));
+    return vec3(_mm_sub_ps(_mm_mul_ps(uYzx, vZxy), _mm_mul_ps(uZxy, vYzx)));
+#else
     return vec3(u.val[1] * v.val[2] - u.val[2] * v.val[1],
                 u.val[2] * v.val[0] - u.val[0] * v.val[2],
                 u.val[0] * v.val[1] - u.val[1] * v.val[0]);
+#endif
 }
 
 inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_sphere() {
+inline vec3 random_in_unit_sphere(pcg32& rng) {
     while (true) {
-        auto p = vec3::random(-1,1);
+        auto p = vec3::random(rng, -1, 1);
         if (p.length_squared() >= 1) continue;
         return p;
     } 
 }
 
-inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+inline vec3 random_unit_vector(pcg32& rng) {
+    return unit_vector(random_in_unit_sphere(rng));
 }
 
-inline vec3 random_in_hemisphere(const vec3& normal) {
-    vec3 in_unit_sphere = random_in_unit_sphere();
+inline vec3 random_in_hemisphere(const vec3& normal, pcg32& rng) {
+    vec3 in_unit_sphere = random_in_unit_sphere(rng);
     if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
@@ -0,0 +1,117 @@
+#ifndef VEC3XN_H
+#define VEC3XN_H
+
+#include "cpuFeatures.h"
+
+// Several 3D vectors side by side, one register per component, for kernels
+// that work on a batch at once: lane i of x, y and z is vector i. The
+// arithmetic matches vec3 lane for lane, with dot adding x, y and z in that
+// order, so a batch kernel can reproduce a scalar one bit for bit.
+//
+// vec3x4 needs SSE2, vec3x8 AVX and vec3x16 AVX-512; each is only defined
+// where the translation unit is compiled for that instruction set.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+
+struct vec3x4 {
+    static const int LANES = 4;
+    __m128 x, y, z;
+
+    SIMD_INLINE vec3x4() {}
+    SIMD_INLINE vec3x4(__m128 x, __m128 y, __m128 z) : x(x), y(y), z(z) {}
+    // every lane the same vector
+    SIMD_INLINE vec3x4(float vx, float vy, float vz) : x(_mm_set1_ps(vx)), y(_mm_set1_ps(vy)), z(_mm_set1_ps(vz)) {}
+
+    // lanes from three component arrays, at any alignment
+    SIMD_INLINE static vec3x4 load(const float* px, const float* py, const float* pz) {
+        return vec3x4(_mm_loadu_ps(px), _mm_loadu_ps(py), _mm_loadu_ps(pz));
+    }
+};
+
+SIMD_INLINE vec3x4 operator+(const vec3x4& u, const vec3x4& v) {
+    return vec3x4(_mm_add_ps(u.x, v.x), _mm_add_ps(u.y, v.y), _mm_add_ps(u.z, v.z));
+}
+
+SIMD_INLINE vec3x4 operator-(const vec3x4& u, const vec3x4& v) {
+    return vec3x4(_mm_sub_ps(u.x, v.x), _mm_sub_ps(u.y, v.y), _mm_sub_ps(u.z, v.z));
+}
+
+SIMD_INLINE vec3x4 operator*(__m128 t, const vec3x4& v) {
+    return vec3x4(_mm_mul_ps(t, v.x), _mm_mul_ps(t, v.y), _mm_mul_ps(t, v.z));
+}
+
+SIMD_INLINE __m128 dot(const vec3x4& u, const vec3x4& v) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(u.x, v.x), _mm_mul_ps(u.y, v.y)), _mm_mul_ps(u.z, v.z));
+}
+#endif
+
+#if defined(__AVX__)
+#include <immintrin.h>
+
+struct vec3x8 {
+    static const int LANES = 8;
+    __m256 x, y, z;
+
+    SIMD_INLINE vec3x8() {}
+    SIMD_INLINE vec3x8(__m256 x, __m256 y, __m256 z) : x(x), y(y), z(z) {}
+    SIMD_INLINE vec3x8(float vx, float vy, float vz)
+        : x(_mm256_set1_ps(vx)), y(_mm256_set1_ps(vy)), z(_mm256_set1_ps(vz)) {}
+
+    SIMD_INLINE static vec3x8 load(const float* px, const float* py, const float* pz) {
+        return vec3x8(_mm256_loadu_ps(px), _mm256_loadu_ps(py), _mm256_loadu_ps(pz));
+    }
+};
+
+SIMD_INLINE vec3x8 operator+(const vec3x8& u, const vec3x8& v) {
+    return vec3x8(_mm256_add_ps(u.x, v.x), _mm256_add_ps(u.y, v.y), _mm256_add_ps(u.z, v.z));
+}
+
+SIMD_INLINE vec3x8 operator-(const vec3x8& u, const vec3x8& v) {
+    return vec3x8(_mm256_sub_ps(u.x, v.x), _mm256_sub_ps(u.y, v.y), _mm256_sub_ps(u.z, v.z));
+}
+
+SIMD_INLINE vec3x8 operator*(__m256 t, const vec3x8& v) {
+    return vec3x8(_mm256_mul_ps(t, v.x), _mm256_mul_ps(t, v.y), _mm256_mul_ps(t, v.z));
+}
+
+SIMD_INLINE __m256 dot(const vec3x8& u, const vec3x8& v) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u.x, v.x), _mm256_mul_ps(u.y, v.y)), _mm256_mul_ps(u.z, v.z));
+}
+#endif
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+
+struct vec3x16 {
+    static const int LANES = 16;
+    __m512 x, y, z;
+
+    SIMD_INLINE vec3x16() {}
+    SIMD_INLINE vec3x16(__m512 x, __m512 y, __m512 z) : x(x), y(y), z(z) {}
+    SIMD_INLINE vec3x16(float vx, float vy, float vz)
+        : x(_mm512_set1_ps(vx)), y(_mm512_set1_ps(vy)), z(_mm512_set1_ps(vz)) {}
+
+    SIMD_INLINE static vec3x16 load(const float* px, const float* py, const float* pz) {
+        return vec3x16(_mm512_loadu_ps(px), _mm512_loadu_ps(py), _mm512_loadu_ps(pz));
+    }
+};
+
+SIMD_INLINE vec3x16 operator+(const vec3x16& u, const vec3x16& v) {
+    return vec3x16(_mm512_add_ps(u.x, v.x), _mm512_add_ps(u.y, v.y), _mm512_add_ps(u.z, v.z));
+}
+
+SIMD_INLINE vec3x16 operator-(const vec3x16& u, const vec3x16& v) {
+    return vec3x16(_mm512_sub_ps(u.x, v.x), _mm512_sub_ps(u.y, v.y), _mm512_sub_ps(u.z, v.z));
+}
+
+SIMD_INLINE vec3x16 operator*(__m512 t, const vec3x16& v) {
+    return vec3x16(_mm512_mul_ps(t, v.x), _mm512_mul_ps(t, v.y), _mm512_mul_ps(t, v.z));
+}
+
+SIMD_INLINE __m512 dot(const vec3x16& u, const vec3x16& v) {
+    return _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(u.x, v.x), _mm512_mul_ps(u.y, v.y)), _mm512_mul_ps(u.z, v.z));
+}
+#endif
+
+#endif
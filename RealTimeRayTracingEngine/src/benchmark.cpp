@@ -0,0 +1,836 @@
+// Headless benchmarks for the renderer core. No window or GL context needed.
+//
+//   ./RayTracingBench [section...]
+//
+// Runs every section when none is named.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "renderer.h"
+#include "sphere.h"
+#include "material.h"
+#include "bvh.h"
+#include "bvh4.h"
+#include "grid.h"
+#include "sphereList.h"
+#include "cpuFeatures.h"
+#include "dispatch.h"
+#include "instance.h"
+#include "threadPool.h"
+
+static const int BENCH_WIDTH = 320;
+static const int BENCH_HEIGHT = 180;
+static const int BENCH_DEPTH = 20;
+
+static double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A ground sphere plus count small spheres of random material. The area they
+// are spread over grows with the count so the density stays about the same.
+static hittableList sphere_scene(int count, uint64_t seed = 42) {
+    pcg32 rng(seed, 1);
+    hittableList world;
+    materialTable& materials = world.get_materials();
+    uint32_t ground = materials.add(make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground));
+
+    float extent = 2.0f * sqrt(static_cast<float>(count));
+    for (int i = 0; i < count; i++) {
+        float x = random_float(rng, -extent, extent);
+        float z = random_float(rng, -extent, extent);
+        float radius = random_float(rng, 0.1f, 0.3f);
+        float choose_mat = random_float(rng);
+
+        shared_ptr<material> mat;
+        if (choose_mat < 0.8f) {
+            mat = make_shared<lambertian>(vec3::random(rng));
+        } else if (choose_mat < 0.95f) {
+            mat = make_shared<metal>(vec3::random(rng, 0.5f, 1.0f), random_float(rng, 0.0f, 0.5f));
+        } else {
+            mat = make_shared<dielectric>(1.5);
+        }
+        world.add(make_shared<sphere>(point3(x, radius, z), radius, materials.add(mat)));
+    }
+    return world;
+}
+
+static Camera bench_camera() {
+    return Camera(point3(13,4,3), point3(0,0,0), vec3(0,1,0), 40, static_cast<float>(BENCH_WIDTH) / BENCH_HEIGHT);
+}
+
+// ---------------------------------------------------------------------------
+// integrator: recursive path tracer taking the scene by value (the original
+// Renderer::ray_color) against the iterative const-reference loop
+
+static color legacy_ray_color(const ray& r, hittableList world, int depth, pcg32& rng, long long& rays) {
+    hit_record hit;
+
+    if (depth <= 0)
+        return color(0,0,0);
+
+    rays++;
+    if (world.hit(r, 0.001, infinity, hit)) {
+        ray scattered;
+        color attenuation;
+        if (world.get_materials()[hit.mat_id].scatter(r, hit, attenuation, scattered, rng))
+            return attenuation * legacy_ray_color(scattered, world, depth-1, rng, rays);
+        return color(0,0,0);
+    }
+
+    vec3 unit_direction = unit_vector(r.direction());
+    auto t = 0.5f *(unit_direction.y() + 1.0f);
+    return (1.0f-t)*color(1.0f, 1.0f, 1.0f) + t*color(0.5f, 0.7f, 1.0f);
+}
+
+static double legacy_mrays(const hittableList& world, const Camera& cam) {
+    long long rays = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int j = 0; j < BENCH_HEIGHT; j++) {
+        for (int i = 0; i < BENCH_WIDTH; i++) {
+            pcg32 rng(static_cast<uint64_t>(j * BENCH_WIDTH + i), 0);
+            auto u = (i + random_float(rng)) / (BENCH_WIDTH-1);
+            auto v = (j + random_float(rng)) / (BENCH_HEIGHT-1);
+            legacy_ray_color(cam.get_ray(u, v), world, BENCH_DEPTH, rng, rays);
+        }
+    }
+    return rays / (elapsedMs(start) * 1000.0);
+}
+
+static double renderer_mrays(const hittableList& world, const Camera& cam) {
+    Renderer renderer(BENCH_WIDTH, BENCH_HEIGHT, 1, BENCH_DEPTH, 1);
+    // the same brute-force list and one ray at a time, so only the path
+    // loops differ
+    renderer.setAccelerator(Accelerator::List);
+    renderer.setPacketTracing(false);
+    renderer.setScene(world, cam);
+    renderer.renderScene();
+    const RenderStats& stats = renderer.getStats();
+    return stats.frameRays / (stats.frameMs * 1000.0);
+}
+
+static void bench_integrator() {
+    printf("== integrator: single thread, %dx%d, 1 spp, depth %d\n", BENCH_WIDTH, BENCH_HEIGHT, BENCH_DEPTH);
+    printf("%10s %16s %16s %8s\n", "objects", "recursive Mr/s", "iterative Mr/s", "speedup");
+    Camera cam = bench_camera();
+    for (int count : {4, 16, 64, 256, 1024}) {
+        hittableList world = sphere_scene(count);
+        double before = legacy_mrays(world, cam);
+        double after = renderer_mrays(world, cam);
+        printf("%10d %16.3f %16.3f %7.2fx\n", count + 1, before, after, after / before);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// roulette: Russian roulette against running every path to the depth limit.
+// The mean pixel value must agree within noise, the time should not.
+
+static void bench_roulette() {
+    const int spp = 8;
+    const int depth = 50;
+    printf("== roulette: single thread, %dx%d, %d spp, depth %d, 257 objects\n", BENCH_WIDTH, BENCH_HEIGHT, spp, depth);
+    printf("%14s %10s %12s %12s %12s\n", "mode", "ms", "Mrays", "Mpaths/s", "mean value");
+
+    hittableList world = sphere_scene(256);
+    for (int minBounces : {-1, 5, 3, 1}) {
+        Renderer renderer(BENCH_WIDTH, BENCH_HEIGHT, spp, depth, 1);
+        renderer.setScene(world, bench_camera());
+        renderer.setRussianRoulette(minBounces >= 0, minBounces);
+        renderer.renderScene();
+
+        const RenderStats& stats = renderer.getStats();
+        double mean = 0;
+        for (unsigned char c : renderer.getPixels())
+            mean += c;
+        mean /= renderer.getPixels().size();
+
+        std::string mode = minBounces < 0 ? std::string("off") : "min " + std::to_string(minBounces);
+        printf("%14s %10.1f %12.2f %12.3f %12.2f\n", mode.c_str(), stats.frameMs, stats.frameRays * 1e-6,
+               stats.frameSamples / (stats.frameMs * 1000.0), mean);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// accel: acceleration structures against brute force on growing scenes
+
+static const char* accelerator_name(Accelerator kind) {
+    switch (kind) {
+    case Accelerator::List: return "list";
+    case Accelerator::BVH: return "bvh";
+    case Accelerator::BVH4: return "bvh4";
+    case Accelerator::BVH4Quantized: return "bvh4q";
+    case Accelerator::Grid: return "grid";
+    case Accelerator::SphereList: return "spheres";
+    }
+    return "?";
+}
+
+static void bench_accel() {
+    const int spp = 1;
+    const int depth = 5;
+    printf("== accel: single thread, %dx%d, %d spp, depth %d\n", BENCH_WIDTH, BENCH_HEIGHT, spp, depth);
+    printf("%10s %8s %10s %10s %10s %12s %12s %10s\n",
+           "objects", "accel", "build ms", "nodes", "KiB", "nodes/ray", "prims/ray", "Mrays/s");
+
+    for (int count : {64, 1024, 16384, 100000}) {
+        hittableList world = sphere_scene(count);
+        for (Accelerator kind : {Accelerator::List, Accelerator::SphereList, Accelerator::BVH, Accelerator::BVH4,
+                                 Accelerator::BVH4Quantized, Accelerator::Grid}) {
+            // brute force gets too slow to be worth waiting for
+            if ((kind == Accelerator::List || kind == Accelerator::SphereList) && count > 1024)
+                continue;
+
+            Renderer renderer(BENCH_WIDTH, BENCH_HEIGHT, spp, depth, 1);
+            renderer.setAccelerator(kind);
+            renderer.setScene(world, bench_camera());
+            renderer.renderScene();
+
+            const RenderStats& stats = renderer.getStats();
+            double rays = std::max(stats.traversal.rays, 1LL);
+            printf("%10d %8s %10.2f %10d %10.1f %12.1f %12.1f %10.3f\n", count + 1, accelerator_name(kind),
+                   stats.accel.buildMs, stats.accel.nodes, stats.accel.bytes / 1024.0,
+                   stats.traversal.nodes / rays, stats.traversal.prims / rays,
+                   stats.frameRays / (stats.frameMs * 1000.0));
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// refit: dragging spheres around a large scene, as the object controls do
+
+// Rays from the camera whose closest hit differs between two structures, or
+// lies further apart than the given fraction of its distance
+static int count_mismatches(const hittable& a, const hittable& b, int rays, uint64_t seed, float tolerance = 0.0f) {
+    pcg32 rng(seed, 7);
+    Camera cam = bench_camera();
+    int mismatches = 0;
+    for (int i = 0; i < rays; i++) {
+        float u = random_float(rng);
+        float v = random_float(rng);
+        ray r = cam.get_ray(u, v);
+        hit_record ra, rb;
+        bool ha = a.hit(r, 0.001f, infinity, ra);
+        bool hb = b.hit(r, 0.001f, infinity, rb);
+        if (ha != hb || (ha && std::fabs(ra.t - rb.t) > tolerance * rb.t))
+            mismatches++;
+    }
+    return mismatches;
+}
+
+static shared_ptr<accelStructure> make_tree(Accelerator kind, const std::vector<shared_ptr<hittable>>& objects) {
+    if (kind == Accelerator::BVH4)
+        return make_shared<bvh4>(objects);
+    if (kind == Accelerator::BVH4Quantized)
+        return make_shared<bvh4>(objects, 4, BvhBuilder::SAH, nullptr, true);
+    return make_shared<bvh>(objects);
+}
+
+static void bench_refit() {
+    const int count = 100000;
+    const int moves = 1000;
+    printf("== refit: %d spheres, %d single-sphere moves per pattern\n", count + 1, moves);
+    printf("%8s %14s %12s %12s %10s %12s\n", "accel", "pattern", "us/refit", "SAH cost", "rebuilds", "mismatches");
+
+    for (Accelerator kind : {Accelerator::BVH, Accelerator::BVH4, Accelerator::BVH4Quantized}) {
+        // the same scene and moves for each
+        hittableList world = sphere_scene(count);
+        auto start = std::chrono::steady_clock::now();
+        shared_ptr<accelStructure> tree = make_tree(kind, world.get_objects());
+        printf("%8s full build: %.2f ms, SAH cost %.1f\n", accelerator_name(kind), elapsedMs(start),
+               tree->stats().sahCost);
+
+        pcg32 rng(3, 3);
+        for (float step : {0.01f, 0.5f, 20.0f}) {
+            double totalMs = 0;
+            int rebuildsBefore = tree->stats().rebuilds;
+            for (int m = 0; m < moves; m++) {
+                int index = 1 + static_cast<int>(random_float(rng) * count);
+                auto obj = std::static_pointer_cast<sphere>(world.get(index));
+                vec3 offset = vec3::random(rng, -step, step);
+                obj->set_center(obj->get_center() + vec3(offset.x(), 0, offset.z()));
+                tree->refit(std::vector<int>(1, index));
+                totalMs += tree->stats().lastRefitMs;
+            }
+            // Compare against a fresh build rather than the list: distant small
+            // spheres produce float-noise hits outside their own bounds that any
+            // box-culling structure rejects.
+            shared_ptr<accelStructure> fresh = make_tree(kind, world.get_objects());
+            int mismatches = count_mismatches(*tree, *fresh, 20000, 11);
+            printf("%8s %11s%.2f %12.2f %12.1f %10d %12d\n", accelerator_name(kind), "step ", step,
+                   totalMs * 1000.0 / moves, tree->stats().sahCost, tree->stats().rebuilds - rebuildsBefore,
+                   mismatches);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// validate: every accelerator must find the same closest hits as brute force
+
+static void bench_validate() {
+    const int rays = 20000;
+    printf("== validate: %d camera rays, closest hit against hittableList::hit\n", rays);
+    printf("%10s %12s %12s %12s %12s %12s %12s %12s\n", "objects", "bvh", "bvh4", "bvh4q", "lbvh", "lbvh+treelet", "grid",
+           "spheres");
+
+    for (int count : {16, 256, 4096}) {
+        hittableList world = sphere_scene(count);
+        bvh tree(world.get_objects());
+        bvh4 wide(world.get_objects());
+        bvh4 quantized(world.get_objects(), 4, BvhBuilder::SAH, nullptr, true);
+        bvh linear(world.get_objects(), 4, BvhBuilder::LBVH);
+        bvh treelets(world.get_objects(), 4, BvhBuilder::LBVHTreelet);
+        grid cells(world.get_objects());
+        sphereList flat(world.get_objects());
+        printf("%10d %12d %12d %12d %12d %12d %12d %12d\n", count + 1, count_mismatches(tree, world, rays, 5),
+               count_mismatches(wide, world, rays, 5), count_mismatches(quantized, world, rays, 5),
+               count_mismatches(linear, world, rays, 5), count_mismatches(treelets, world, rays, 5),
+               count_mismatches(cells, world, rays, 5), count_mismatches(flat, world, rays, 5));
+    }
+}
+
+// ---------------------------------------------------------------------------
+// build: top-down SAH against the parallel linear builders on large scenes
+
+// Closest hits per second for camera rays on the calling thread
+static double trace_mrays(const hittable& scene, int rays) {
+    pcg32 rng(9, 7);
+    Camera cam = bench_camera();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rays; i++) {
+        float u = random_float(rng);
+        float v = random_float(rng);
+        hit_record rec;
+        scene.hit(cam.get_ray(u, v), 0.001f, infinity, rec);
+    }
+    return rays / (elapsedMs(start) * 1000.0);
+}
+
+static const char* builder_name(BvhBuilder builder) {
+    switch (builder) {
+    case BvhBuilder::SAH: return "sah";
+    case BvhBuilder::LBVH: return "lbvh";
+    case BvhBuilder::LBVHTreelet: return "lbvh+treelet";
+    }
+    return "?";
+}
+
+static void bench_build() {
+    const int rays = 200000;
+    ThreadPool single(1);
+    ThreadPool all(0);
+    printf("== build: %d hardware threads, traversal of %d camera rays on one thread\n", all.size(), rays);
+    printf("%10s %14s %8s %10s %10s %8s %10s %10s\n",
+           "objects", "builder", "threads", "build ms", "SAH cost", "depth", "Mrays/s", "mismatches");
+
+    for (int count : {100000, 1000000}) {
+        hittableList world = sphere_scene(count);
+        bvh reference(world.get_objects());
+        for (BvhBuilder builder : {BvhBuilder::SAH, BvhBuilder::LBVH, BvhBuilder::LBVHTreelet}) {
+            for (ThreadPool* pool : {&single, &all}) {
+                // the SAH builder is single threaded
+                if (builder == BvhBuilder::SAH && pool != &single)
+                    continue;
+                if (pool == &all && all.size() == 1)
+                    continue;
+
+                auto start = std::chrono::steady_clock::now();
+                bvh tree(world.get_objects(), 4, builder, pool);
+                double buildMs = elapsedMs(start);
+                printf("%10d %14s %8d %10.1f %10.1f %8d %10.3f %10d\n", count + 1, builder_name(builder),
+                       pool->size(), buildMs, tree.stats().sahCost, tree.stats().maxDepth,
+                       trace_mrays(tree, rays), count_mismatches(tree, reference, 20000, 13));
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// instancing: one sphere cluster placed many times, against the same spheres
+// copied into the scene one by one
+
+static void bench_instancing() {
+    const int clusterSize = 64;
+    const int instances = 2000;
+    const int spp = 1;
+    const int depth = 5;
+    printf("== instancing: %d instances of a %d-sphere cluster, single thread, %dx%d, %d spp, depth %d\n",
+           instances, clusterSize, BENCH_WIDTH, BENCH_HEIGHT, spp, depth);
+
+    // both scenes share one table, which the cluster's spheres refer to as well
+    pcg32 rng(17, 5);
+    materialTable materials;
+    hittableList cluster;
+    for (int i = 0; i < clusterSize; i++) {
+        point3 center = 1.5f * random_in_unit_sphere(rng) + vec3(0, 1.5f, 0);
+        float radius = random_float(rng, 0.1f, 0.3f);
+        cluster.add(make_shared<sphere>(center, radius, materials.add(make_shared<lambertian>(vec3::random(rng)))));
+    }
+    auto blas = make_shared<bvh>(cluster.get_objects());
+
+    hittableList instanced, flattened;
+    uint32_t groundMaterial = materials.add(make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+    auto ground = make_shared<sphere>(point3(0,-1000,0), 1000, groundMaterial);
+    instanced.add(ground);
+    flattened.add(ground);
+    float extent = 2.0f * sqrt(static_cast<float>(instances) * 4.0f);
+    for (int i = 0; i < instances; i++) {
+        float x = random_float(rng, -extent, extent);
+        float z = random_float(rng, -extent, extent);
+        float angle = random_float(rng, 0.0f, 360.0f);
+        float size = random_float(rng, 0.5f, 1.5f);
+        transform xf = transform::translate(vec3(x, 0, z)) * transform::rotate_y(angle) * transform::scale(size);
+        // every other instance gets a material of its own
+        uint32_t mat = materialTable::NONE;
+        if (i % 2)
+            mat = materials.add(make_shared<metal>(vec3::random(rng, 0.5f, 1.0f), 0.1f));
+        instanced.add(make_shared<instance>(blas, xf, mat));
+
+        for (const auto &object : cluster.get_objects()) {
+            auto s = std::static_pointer_cast<sphere>(object);
+            flattened.add(make_shared<sphere>(xf.apply_point(s->get_center()), s->get_radius() * size,
+                                              mat != materialTable::NONE ? mat : s->get_material()));
+        }
+    }
+    instanced.get_materials() = materials;
+    flattened.get_materials() = materials;
+
+    printf("%12s %10s %10s %12s %10s %12s\n", "scene", "objects", "build ms", "memory KiB", "Mrays/s", "move ms");
+    for (int pass = 0; pass < 2; pass++) {
+        const hittableList& world = pass == 0 ? flattened : instanced;
+        int objects = static_cast<int>(world.get_objects().size());
+        Renderer renderer(BENCH_WIDTH, BENCH_HEIGHT, spp, depth, 1);
+        renderer.setScene(world, bench_camera());
+        renderer.renderScene();
+        const RenderStats& stats = renderer.getStats();
+
+        // objects themselves plus the structures over them; the cluster and
+        // its tree count once for all instances
+        size_t bytes = stats.accel.bytes;
+        if (pass == 0) {
+            bytes += (objects - 1) * sizeof(sphere);
+        } else {
+            bytes += (objects - 1) * sizeof(instance) + clusterSize * sizeof(sphere) + blas->stats().bytes;
+        }
+
+        // move one placement of the cluster
+        double moveMs;
+        if (pass == 0) {
+            auto start = std::chrono::steady_clock::now();
+            for (int k = 0; k < clusterSize; k++) {
+                auto s = std::static_pointer_cast<sphere>(world.get(1 + k));
+                s->set_center(s->get_center() + vec3(0.5f, 0, 0));
+            }
+            renderer.geometryChanged();
+            moveMs = elapsedMs(start);
+        } else {
+            auto start = std::chrono::steady_clock::now();
+            auto inst = std::static_pointer_cast<instance>(world.get(1));
+            inst->set_transform(transform::translate(vec3(0.5f, 0, 0)) * inst->get_transform());
+            renderer.geometryChanged(1);
+            moveMs = elapsedMs(start);
+        }
+
+        printf("%12s %10d %10.2f %12.1f %10.3f %12.3f\n", pass == 0 ? "flattened" : "instanced", objects,
+               stats.accel.buildMs, bytes / 1024.0, stats.frameRays / (stats.frameMs * 1000.0), moveMs);
+    }
+    printf("bottom level refits after moving: %d\n", blas->stats().refits);
+    // Near the silhouette the sphere test's rounding moves hits noticeably,
+    // so a few grazing rays still tell the two apart
+    printf("rays hitting more than 1e-3 of t apart: %d of 20000\n",
+           count_mismatches(bvh(instanced.get_objects()), bvh(flattened.get_objects()), 20000, 3, 1e-3f));
+}
+
+// ---------------------------------------------------------------------------
+// occlusion: shadow-style rays answered with the any-hit query against a
+// closest-hit search over the same segment
+
+static void bench_occlusion() {
+    const int rays = 200000;
+    const float maxDistance = 20.0f;
+    printf("== occlusion: %d rays among the spheres, up to %.0f units long, single thread\n", rays, maxDistance);
+    printf("%10s %8s %12s %12s %10s %12s %12s %10s %12s\n",
+           "objects", "accel", "hit Mrays/s", "occ Mrays/s", "speedup", "prims/hit", "prims/occ", "blocked", "disagree");
+
+    for (int count : {1024, 100000}) {
+        hittableList world = sphere_scene(count);
+        float extent = 2.0f * sqrt(static_cast<float>(count));
+
+        // points among the spheres toward random, nearly horizontal
+        // directions, as shadow rays toward a low light would be, so a fair
+        // share of them is blocked and many cross several spheres
+        std::vector<ray> shadowRays;
+        shadowRays.reserve(rays);
+        pcg32 rng(21, 3);
+        for (int i = 0; i < rays; i++) {
+            point3 origin(random_float(rng, -extent, extent), random_float(rng, 0.05f, 0.3f),
+                          random_float(rng, -extent, extent));
+            vec3 dir = random_unit_vector(rng);
+            shadowRays.push_back(ray(origin, vec3(dir.x(), 0.05f * std::fabs(dir.y()), dir.z())));
+        }
+
+        for (Accelerator kind : {Accelerator::List, Accelerator::SphereList, Accelerator::BVH, Accelerator::BVH4,
+                                 Accelerator::BVH4Quantized, Accelerator::Grid}) {
+            if ((kind == Accelerator::List || kind == Accelerator::SphereList) && count > 1024)
+                continue;
+
+            shared_ptr<hittable> scene;
+            switch (kind) {
+            case Accelerator::List: scene = make_shared<hittableList>(world); break;
+            case Accelerator::BVH: scene = make_shared<bvh>(world.get_objects()); break;
+            case Accelerator::BVH4: scene = make_shared<bvh4>(world.get_objects()); break;
+            case Accelerator::BVH4Quantized:
+                scene = make_shared<bvh4>(world.get_objects(), 4, BvhBuilder::SAH, nullptr, true);
+                break;
+            case Accelerator::Grid: scene = make_shared<grid>(world.get_objects()); break;
+            case Accelerator::SphereList: scene = make_shared<sphereList>(world.get_objects()); break;
+            }
+
+            std::vector<char> blocked(rays);
+            traversal_counters() = TraversalCounters();
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < rays; i++) {
+                hit_record rec;
+                blocked[i] = scene->hit(shadowRays[i], 0.001f, maxDistance, rec);
+            }
+            double hitMs = elapsedMs(start);
+            long long hitPrims = traversal_counters().prims;
+
+            int disagree = 0;
+            int blockedCount = static_cast<int>(std::count(blocked.begin(), blocked.end(), 1));
+            traversal_counters() = TraversalCounters();
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < rays; i++)
+                disagree += scene->occluded(shadowRays[i], 0.001f, maxDistance) != static_cast<bool>(blocked[i]);
+            double occMs = elapsedMs(start);
+            long long occPrims = traversal_counters().prims;
+
+            printf("%10d %8s %12.3f %12.3f %9.2fx %12.1f %12.1f %10d %12d\n", count + 1, accelerator_name(kind),
+                   rays / (hitMs * 1000.0), rays / (occMs * 1000.0), hitMs / occMs,
+                   static_cast<double>(hitPrims) / rays, static_cast<double>(occPrims) / rays, blockedCount, disagree);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// packets: camera rays of 4x4 pixel blocks traced as one packet against the
+// same rays traced one by one, then whole frames with packet tracing on and off
+
+static void bench_packets() {
+    const int width = 640;
+    const int height = 360;
+    const int block = 4;
+    printf("== packets: single thread, %dx%d camera rays in %dx%d blocks\n", width, height, block, block);
+    printf("%10s %8s %12s %12s %10s %12s %14s %12s\n",
+           "objects", "accel", "ray Mrays/s", "pkt Mrays/s", "speedup", "nodes/ray", "pkt nodes/ray", "mismatches");
+
+    Camera cam(point3(13,4,3), point3(0,0,0), vec3(0,1,0), 40, static_cast<float>(width) / height);
+    std::vector<rayPacket> packets;
+    for (int by = 0; by < height; by += block) {
+        for (int bx = 0; bx < width; bx += block) {
+            rayPacket packet;
+            for (int j = by; j < std::min(by + block, height); j++)
+                for (int i = bx; i < std::min(bx + block, width); i++)
+                    packet.add(cam.get_ray((i + 0.5f) / (width - 1), (j + 0.5f) / (height - 1)));
+            packets.push_back(packet);
+        }
+    }
+    const int rays = width * height;
+
+    for (int count : {1024, 16384, 100000}) {
+        hittableList world = sphere_scene(count);
+        for (Accelerator kind : {Accelerator::BVH, Accelerator::BVH4}) {
+            shared_ptr<accelStructure> accel;
+            if (kind == Accelerator::BVH)
+                accel = make_shared<bvh>(world.get_objects());
+            else
+                accel = make_shared<bvh4>(world.get_objects());
+
+            std::vector<float> single(rays);
+            traversal_counters() = TraversalCounters();
+            auto start = std::chrono::steady_clock::now();
+            int r = 0;
+            for (const auto &packet : packets) {
+                for (int i = 0; i < packet.count; i++) {
+                    hit_record rec;
+                    single[r++] = accel->hit(packet.get(i), 0.001f, infinity, rec) ? static_cast<float>(rec.t) : -1.0f;
+                }
+            }
+            double singleMs = elapsedMs(start);
+            double singleNodes = static_cast<double>(traversal_counters().nodes) / rays;
+
+            int mismatches = 0;
+            traversal_counters() = TraversalCounters();
+            start = std::chrono::steady_clock::now();
+            r = 0;
+            for (const auto &packet : packets) {
+                hit_record recs[rayPacket::SIZE];
+                bool hits[rayPacket::SIZE];
+                accel->hit_packet(packet, 0.001f, infinity, recs, hits);
+                for (int i = 0; i < packet.count; i++)
+                    mismatches += (hits[i] ? static_cast<float>(recs[i].t) : -1.0f) != single[r++];
+            }
+            double packetMs = elapsedMs(start);
+            double packetNodes = static_cast<double>(traversal_counters().nodes) / rays;
+
+            printf("%10d %8s %12.3f %12.3f %9.2fx %12.1f %14.2f %12d\n", count + 1, accelerator_name(kind),
+                   rays / (singleMs * 1000.0), rays / (packetMs * 1000.0), singleMs / packetMs,
+                   singleNodes, packetNodes, mismatches);
+        }
+    }
+
+    const int spp = 1;
+    const int depth = 5;
+    printf("frames: single thread, %dx%d, %d spp, depth %d, 16385 objects\n", BENCH_WIDTH, BENCH_HEIGHT, spp, depth);
+    printf("%10s %8s %10s %10s %16s\n", "packets", "accel", "ms", "Mrays/s", "pixels differing");
+    hittableList world = sphere_scene(16384);
+    for (Accelerator kind : {Accelerator::BVH, Accelerator::BVH4}) {
+        std::vector<unsigned char> reference;
+        for (bool enabled : {false, true}) {
+            Renderer renderer(BENCH_WIDTH, BENCH_HEIGHT, spp, depth, 1);
+            renderer.setAccelerator(kind);
+            renderer.setPacketTracing(enabled);
+            renderer.setScene(world, bench_camera());
+            renderer.renderScene();
+            const RenderStats& stats = renderer.getStats();
+
+            int differing = 0;
+            if (!enabled) {
+                reference = renderer.getPixels();
+            } else {
+                const std::vector<unsigned char>& pixels = renderer.getPixels();
+                for (size_t p = 0; p < pixels.size(); p += 3)
+                    differing += !std::equal(pixels.begin() + p, pixels.begin() + p + 3, reference.begin() + p);
+            }
+            printf("%10s %8s %10.1f %10.3f %16d\n", enabled ? "on" : "off", accelerator_name(kind), stats.frameMs,
+                   stats.frameRays / (stats.frameMs * 1000.0), differing);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// wavefront: the ray-stream integrator against depth-first paths. With the
+// same seed both must produce the same image.
+
+static void bench_wavefront() {
+    const int spp = 4;
+    const int depth = 20;
+    printf("== wavefront: single thread, %dx%d, %d spp, depth %d, bvh\n", BENCH_WIDTH, BENCH_HEIGHT, spp, depth);
+    printf("%10s %10s %12s %10s %12s %12s %12s %16s\n",
+           "objects", "roulette", "integrator", "ms", "Mrays/s", "Mpaths/s", "mean value", "pixels differing");
+
+    for (int count : {64, 1024, 16384}) {
+        hittableList world = sphere_scene(count);
+        for (bool roulette : {false, true}) {
+            std::vector<unsigned char> reference;
+            for (Integrator mode : {Integrator::DepthFirst, Integrator::Wavefront}) {
+                Renderer renderer(BENCH_WIDTH, BENCH_HEIGHT, spp, depth, 1);
+                renderer.setScene(world, bench_camera());
+                renderer.setIntegrator(mode);
+                renderer.setRussianRoulette(roulette);
+                renderer.renderScene();
+                const RenderStats& stats = renderer.getStats();
+                const std::vector<unsigned char>& pixels = renderer.getPixels();
+
+                double mean = 0;
+                for (unsigned char c : pixels)
+                    mean += c;
+                mean /= pixels.size();
+
+                int differing = 0;
+                if (mode == Integrator::DepthFirst) {
+                    reference = pixels;
+                } else {
+                    for (size_t p = 0; p < pixels.size(); p += 3)
+                        differing += !std::equal(pixels.begin() + p, pixels.begin() + p + 3, reference.begin() + p);
+                }
+                printf("%10d %10s %12s %10.1f %12.3f %12.3f %12.2f %16d\n", count + 1, roulette ? "on" : "off",
+                       mode == Integrator::DepthFirst ? "depth-first" : "wavefront", stats.frameMs,
+                       stats.frameRays / (stats.frameMs * 1000.0), stats.frameSamples / (stats.frameMs * 1000.0),
+                       mean, differing);
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// spheres: sphereStore batch tests, per kernel, against one virtual hit per
+// sphere, both brute force and in BVH leaves
+
+static const char* kernel_name(SphereKernel kernel) {
+    switch (kernel) {
+    case SphereKernel::Auto: return "auto";
+    case SphereKernel::Scalar: return "scalar";
+    case SphereKernel::SSE: return "sse";
+    case SphereKernel::SSE42: return "sse4.2";
+    case SphereKernel::AVX2: return "avx2";
+    case SphereKernel::AVX512: return "avx512";
+    }
+    return "?";
+}
+
+static void bench_spheres() {
+    const int rays = 200000;
+    const SphereKernel kernels[] = { SphereKernel::Scalar, SphereKernel::SSE, SphereKernel::SSE42,
+                                     SphereKernel::AVX2, SphereKernel::AVX512 };
+    printf("== spheres: %d camera rays, single thread, cpu %s, auto kernel is %s\n", rays,
+           simd_level_name(cpu_simd_level()), kernel_name(sphereStore::active_kernel()));
+    printf("%10s %8s %6s %10s %10s %12s %12s\n", "objects", "accel", "leaf", "leaves", "kernel", "Mrays/s",
+           "mismatches");
+
+    // brute force, where nothing but the primitive test counts
+    for (int count : {64, 1024}) {
+        hittableList world = sphere_scene(count);
+        printf("%10d %8s %6s %10s %10s %12.3f %12s\n", count + 1, "list", "-", "objects", "-",
+               trace_mrays(world, rays / 10), "-");
+        sphereList flat(world.get_objects());
+        for (SphereKernel kernel : kernels) {
+            if (sphereStore::select_kernel(kernel) != kernel)
+                continue;
+            printf("%10d %8s %6s %10s %10s %12.3f %12d\n", count + 1, "spheres", "-", "spheres",
+                   kernel_name(kernel), trace_mrays(flat, rays / 10), count_mismatches(flat, world, 20000, 5));
+        }
+    }
+
+    // Leaves against leaves of the same tree: distant small spheres produce
+    // float-noise hits outside their own bounds, so brute force is no
+    // reference here (see refit).
+    for (int count : {16384, 100000}) {
+        hittableList world = sphere_scene(count);
+        for (int leafSize : {4, 8}) {
+            for (int wide = 0; wide < 2; wide++) {
+                const char* name = wide ? "bvh4" : "bvh";
+                shared_ptr<hittable> objects, spheres;
+                if (wide) {
+                    objects = make_shared<bvh4>(world.get_objects(), leafSize, BvhBuilder::SAH, nullptr, false,
+                                                LeafFormat::Objects);
+                    spheres = make_shared<bvh4>(world.get_objects(), leafSize, BvhBuilder::SAH, nullptr, false,
+                                                LeafFormat::Spheres);
+                } else {
+                    objects = make_shared<bvh>(world.get_objects(), leafSize, BvhBuilder::SAH, nullptr,
+                                               LeafFormat::Objects);
+                    spheres = make_shared<bvh>(world.get_objects(), leafSize, BvhBuilder::SAH, nullptr,
+                                               LeafFormat::Spheres);
+                }
+                printf("%10d %8s %6d %10s %10s %12.3f %12s\n", count + 1, name, leafSize, "objects", "-",
+                       trace_mrays(*objects, rays), "-");
+                for (SphereKernel kernel : kernels) {
+                    if (sphereStore::select_kernel(kernel) != kernel)
+                        continue;
+                    printf("%10d %8s %6d %10s %10s %12.3f %12d\n", count + 1, name, leafSize, "spheres",
+                           kernel_name(kernel), trace_mrays(*spheres, rays),
+                           count_mismatches(*spheres, *objects, 20000, 5));
+                }
+            }
+        }
+    }
+    sphereStore::select_kernel(SphereKernel::Auto);
+}
+
+// ---------------------------------------------------------------------------
+// dispatch: virtual calls against the closed-set type switch, for the
+// intersection tests alone and for whole frames that also shade
+
+static const char* dispatch_name(Dispatch mode) {
+    return mode == Dispatch::Virtual ? "virtual" : "closed set";
+}
+
+static void bench_dispatch() {
+    const int rays = 200000;
+    const Dispatch modes[] = { Dispatch::Virtual, Dispatch::ClosedSet };
+    printf("== dispatch: %d camera rays, single thread, object leaves, best of 3\n", rays);
+    printf("%10s %8s %12s %12s\n", "objects", "accel", "dispatch", "Mrays/s");
+    for (int count : {64, 1024, 16384, 100000}) {
+        hittableList world = sphere_scene(count);
+        shared_ptr<hittable> scene;
+        if (count <= 1024)
+            scene = make_shared<hittableList>(world);
+        else
+            scene = make_shared<bvh>(world.get_objects(), 4, BvhBuilder::SAH, nullptr, LeafFormat::Objects);
+        // the two modes take turns, best of three, as the difference is small
+        double best[2] = { 0.0, 0.0 };
+        for (int pass = 0; pass < 3; pass++) {
+            for (int m = 0; m < 2; m++) {
+                set_dispatch(modes[m]);
+                best[m] = std::max(best[m], trace_mrays(*scene, count <= 1024 ? rays / 10 : rays));
+            }
+        }
+        for (int m = 0; m < 2; m++)
+            printf("%10d %8s %12s %12.3f\n", count + 1, count <= 1024 ? "list" : "bvh", dispatch_name(modes[m]),
+                   best[m]);
+    }
+
+    const int spp = 4;
+    const int depth = 20;
+    printf("frames: single thread, %dx%d, %d spp, depth %d\n", BENCH_WIDTH, BENCH_HEIGHT, spp, depth);
+    printf("%10s %8s %12s %12s %10s %12s %16s\n",
+           "objects", "accel", "integrator", "dispatch", "ms", "Mrays/s", "pixels differing");
+    for (int count : {64, 16384}) {
+        hittableList world = sphere_scene(count);
+        Accelerator kind = count <= 1024 ? Accelerator::List : Accelerator::BVH;
+        for (Integrator integrator : {Integrator::DepthFirst, Integrator::Wavefront}) {
+            std::vector<unsigned char> reference;
+            for (Dispatch mode : modes) {
+                set_dispatch(mode);
+                Renderer renderer(BENCH_WIDTH, BENCH_HEIGHT, spp, depth, 1);
+                renderer.setAccelerator(kind);
+                renderer.setIntegrator(integrator);
+                renderer.setScene(world, bench_camera());
+                renderer.renderScene();
+                const RenderStats& stats = renderer.getStats();
+                const std::vector<unsigned char>& pixels = renderer.getPixels();
+
+                int differing = 0;
+                if (mode == Dispatch::Virtual) {
+                    reference = pixels;
+                } else {
+                    for (size_t p = 0; p < pixels.size(); p += 3)
+                        differing += !std::equal(pixels.begin() + p, pixels.begin() + p + 3, reference.begin() + p);
+                }
+                printf("%10d %8s %12s %12s %10.1f %12.3f %16d\n", count + 1, accelerator_name(kind),
+                       integrator == Integrator::DepthFirst ? "depth-first" : "wavefront", dispatch_name(mode),
+                       stats.frameMs, stats.frameRays / (stats.frameMs * 1000.0), differing);
+            }
+        }
+    }
+    set_dispatch(Dispatch::ClosedSet);
+}
+
+// ---------------------------------------------------------------------------
+
+struct Section {
+    const char* name;
+    std::function<void()> run;
+};
+
+int main(int argc, char** argv) {
+    std::vector<Section> sections = {
+        {"integrator", bench_integrator},
+        {"roulette", bench_roulette},
+        {"accel", bench_accel},
+        {"refit", bench_refit},
+        {"validate", bench_validate},
+        {"build", bench_build},
+        {"instancing", bench_instancing},
+        {"occlusion", bench_occlusion},
+        {"packets", bench_packets},
+        {"wavefront", bench_wavefront},
+        {"spheres", bench_spheres},
+        {"dispatch", bench_dispatch},
+    };
+
+    for (const auto &section : sections) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++)
+            selected |= strcmp(argv[i], section.name) == 0;
+        if (selected)
+            section.run();
+    }
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include <time.h>
 #include <GLFW/glfw3.h>
 #include <chrono>
+#include <algorithm>
 
 //Dear imgui
 #include "imgui.h"
@@ -9,50 +10,69 @@
 #include "backends/imgui_impl_opengl3.h"
 
 #include "renderer.h"
+#include "renderThread.h"
 #include "sphere.h"
 #include "material.h"
-
-hittableList random_scene() {
+#include "dispatch.h"
+
+// UI-side copy of an editable sphere. The render thread owns the scene, so
+// the controls edit these values and send changes over as edits.
+struct ObjectControl {
+    int index;
+    shared_ptr<sphere> obj;
+    vec3 center;
+    // the sphere's material id, and whether it has an albedo to edit
+    uint32_t mat;
+    bool hasAlbedo;
+    color albedo;
+};
+
+hittableList random_scene(pcg32& rng) {
     hittableList world;
 
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    materialTable& materials = world.get_materials();
+
+    auto ground_material = materials.add(make_shared<lambertian>(color(0.5, 0.5, 0.5)));
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
 
     for (int a = -2; a < 2; a++) {
         for (int b = -2; b < 2; b++) {
-            auto choose_mat = random_float();
-            point3 center(a + 0.9*random_float(), 0.2, b + 0.9*random_float());
+            auto choose_mat = random_float(rng);
+            auto offset_x = random_float(rng);
+            auto offset_z = random_float(rng);
+            point3 center(a + 0.9*offset_x, 0.2, b + 0.9*offset_z);
 
             if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
+                uint32_t sphere_material;
 
                 if (choose_mat < 0.8) {
                     // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
+                    auto albedo = color::random(rng);
+                    albedo = albedo * color::random(rng);
+                    sphere_material = materials.add(make_shared<lambertian>(albedo));
                     world.add(make_shared<sphere>(center, 0.2, sphere_material));
                 } else if (choose_mat < 0.95) {
                     // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_float(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
+                    auto albedo = color::random(rng, 0.5, 1);
+                    auto fuzz = random_float(rng, 0, 0.5);
+                    sphere_material = materials.add(make_shared<metal>(albedo, fuzz));
                     world.add(make_shared<sphere>(center, 0.2, sphere_material));
                 } else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
+                    sphere_material = materials.add(make_shared<dielectric>(1.5));
                     world.add(make_shared<sphere>(center, 0.2, sphere_material));
                 }
             }
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
+    auto material1 = materials.add(make_shared<dielectric>(1.5));
     world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
+    auto material2 = materials.add(make_shared<lambertian>(color(0.4, 0.2, 0.1)));
     world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    auto material3 = materials.add(make_shared<metal>(color(0.7, 0.6, 0.5), 0.0));
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
     return world;
@@ -84,8 +104,9 @@ int main(){
     const int img_height = static_cast<int>(img_width / aspect_ratio);
     const int samples_per_pixel = 1;
     const int max_depth = 20;
+    const int num_threads = 0; // 0 renders with every hardware thread
 
-    Renderer renderer(img_width, img_height, samples_per_pixel, max_depth);
+    Renderer renderer(img_width, img_height, samples_per_pixel, max_depth, num_threads);
 
     //camera setup
     Camera cam(point3(-2,2,1), point3(0,0,-1), vec3(0,1,0), 90, aspect_ratio);;
@@ -95,10 +116,11 @@ int main(){
 
     //world setup
     hittableList world;
-    auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-    auto material_center = make_shared<lambertian>(color(0.7, 0.3, 0.3));
-    auto material_left   = make_shared<metal>(color(0.8, 0.8, 0.8), 0);
-    auto material_right  = make_shared<metal>(color(0.8, 0.6, 0.2), 0);
+    materialTable& materials = world.get_materials();
+    auto material_ground = materials.add(make_shared<lambertian>(color(0.8, 0.8, 0.0)));
+    auto material_center = materials.add(make_shared<lambertian>(color(0.7, 0.3, 0.3)));
+    auto material_left   = materials.add(make_shared<metal>(color(0.8, 0.8, 0.8), 0));
+    auto material_right  = materials.add(make_shared<metal>(color(0.8, 0.6, 0.2), 0));
 
     world.add(make_shared<sphere>(point3( 0.0, -100.5, -1.0), 100.0, material_ground));
     world.add(make_shared<sphere>(point3( 0.0,    0.0, -1.0),   0.5, material_center));
@@ -106,6 +128,41 @@ int main(){
     world.add(make_shared<sphere>(point3( 1.0,    0.0, -1.0),   0.5, material_right));
 
     renderer.setScene(world, cam);
+
+    std::vector<ObjectControl> controls;
+    for(int i = 0; i < world.length(); i++){
+        ObjectControl ctrl;
+        ctrl.index = i;
+        shared_ptr<hittable> obj = world.get(i);
+        if (obj->kind() != HittableKind::Sphere)
+            continue;
+        ctrl.obj = std::static_pointer_cast<sphere>(obj);
+        ctrl.center = ctrl.obj->get_center();
+        ctrl.mat = ctrl.obj->get_material();
+        shared_ptr<material> mat = materials.get(ctrl.mat);
+        ctrl.hasAlbedo = mat->type() == MaterialType::Lambertian || mat->type() == MaterialType::Metal;
+        if (mat->type() == MaterialType::Lambertian)
+            ctrl.albedo = std::static_pointer_cast<lambertian>(mat)->get_albedo();
+        else if (mat->type() == MaterialType::Metal)
+            ctrl.albedo = std::static_pointer_cast<metal>(mat)->get_albedo();
+        controls.push_back(ctrl);
+    }
+
+    // from here on the renderer and the world belong to the render thread
+    RenderThread renderThread(renderer);
+    float max_frame_ms = 0.0f;
+    int accelerator = static_cast<int>(renderer.getAccelerator());
+    int bvh_builder = static_cast<int>(renderer.getBvhBuilder());
+    bool packet_tracing = renderer.getPacketTracing();
+    int integrator = static_cast<int>(renderer.getIntegrator());
+    int dispatch = static_cast<int>(get_dispatch());
+    bool dynamic_resolution = false;
+    float frame_budget_ms = 33.0f;
+    bool adaptive_sampling = false;
+    float noise_threshold = 0.02f;
+    bool show_sample_counts = false;
+    bool russian_roulette = false;
+    int roulette_min_bounces = 3;
     
     //Dear imgui setup
     IMGUI_CHECKVERSION();
@@ -140,32 +197,115 @@ int main(){
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
+        if (renderThread.acquireFrame()) {
+            // Update the texture with the newest ray tracing result
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, img_width, img_height, GL_RGB, GL_UNSIGNED_BYTE, renderThread.currentFrame().pixels.data());
+        }
+
         // Display FPS using ImGui
         ImGui::Begin("Performance");
         ImGui::Text("FPS: %.1f", fps);
+        const RenderStats& stats = renderThread.currentFrame().stats;
+        ImGui::Text("Render: %.1f ms on %d threads", stats.frameMs, renderer.getThreadCount());
+        ImGui::Text("Accumulated: %d spp", stats.accumulatedSamples);
+        const RenderResult& result = renderThread.currentFrame().result;
+        ImGui::Text("Tiles: %d/%d x %dpx%s", result.tilesDone, result.tilesTotal, stats.tileSize,
+                    result.cancelled ? " (cancelled)" : "");
+        ImGui::Text("Steals: %d  Idle: %.1f ms", stats.steals, stats.idleMs);
+
+        if (ImGui::SliderFloat("Max frame time (ms)", &max_frame_ms, 0.0f, 200.0f, max_frame_ms > 0 ? "%.0f" : "off"))
+            renderThread.setFrameBudget(max_frame_ms);
+
+        bool budget_changed = ImGui::Checkbox("Dynamic resolution", &dynamic_resolution);
+        budget_changed |= ImGui::SliderFloat("Frame budget (ms)", &frame_budget_ms, 5.0f, 200.0f);
+        if (budget_changed) {
+            double budget = dynamic_resolution ? frame_budget_ms : 0.0;
+            renderThread.submit([budget](Renderer& r) { r.setTargetFrameTime(budget); });
+        }
+        ImGui::Text("Scale: %.0f%% (%d x %d)", stats.renderScale * 100.0f, stats.renderWidth, stats.renderHeight);
+
+        bool sampling_changed = ImGui::Checkbox("Adaptive sampling", &adaptive_sampling);
+        sampling_changed |= ImGui::SliderFloat("Noise threshold", &noise_threshold, 0.001f, 0.2f, "%.3f");
+        if (sampling_changed) {
+            bool enabled = adaptive_sampling;
+            float threshold = noise_threshold;
+            renderThread.submit([enabled, threshold](Renderer& r) { r.setAdaptiveSampling(enabled, threshold); });
+        }
+        if (ImGui::Checkbox("Show sample counts", &show_sample_counts)) {
+            DebugView view = show_sample_counts ? DebugView::SampleCount : DebugView::None;
+            renderThread.submit([view](Renderer& r) { r.setDebugView(view); });
+        }
+        ImGui::Text("Converged: %d px, %lld samples this frame", stats.convergedPixels, stats.frameSamples);
+
+        bool roulette_changed = ImGui::Checkbox("Russian roulette", &russian_roulette);
+        roulette_changed |= ImGui::SliderInt("Min bounces", &roulette_min_bounces, 0, max_depth);
+        if (roulette_changed) {
+            bool enabled = russian_roulette;
+            int min_bounces = roulette_min_bounces;
+            renderThread.submit([enabled, min_bounces](Renderer& r) { r.setRussianRoulette(enabled, min_bounces); });
+        }
+        ImGui::Text("Rays: %.2f M this frame", stats.frameRays * 1e-6);
+
+        const char* accelerators[] = { "List", "BVH", "BVH4", "BVH4 quantized", "Grid", "Sphere list" };
+        if (ImGui::Combo("Accelerator", &accelerator, accelerators, IM_ARRAYSIZE(accelerators))) {
+            Accelerator kind = static_cast<Accelerator>(accelerator);
+            renderThread.submit([kind](Renderer& r) { r.setAccelerator(kind); });
+        }
+        const char* builders[] = { "SAH", "LBVH", "LBVH + treelets" };
+        if (ImGui::Combo("BVH builder", &bvh_builder, builders, IM_ARRAYSIZE(builders))) {
+            BvhBuilder builder = static_cast<BvhBuilder>(bvh_builder);
+            renderThread.submit([builder](Renderer& r) { r.setBvhBuilder(builder); });
+        }
+        const char* integrators[] = { "Depth-first", "Wavefront" };
+        if (ImGui::Combo("Integrator", &integrator, integrators, IM_ARRAYSIZE(integrators))) {
+            Integrator mode = static_cast<Integrator>(integrator);
+            renderThread.submit([mode](Renderer& r) { r.setIntegrator(mode); });
+        }
+        const char* dispatchModes[] = { "Virtual", "Closed set" };
+        if (ImGui::Combo("Dispatch", &dispatch, dispatchModes, IM_ARRAYSIZE(dispatchModes))) {
+            Dispatch mode = static_cast<Dispatch>(dispatch);
+            renderThread.submit([mode](Renderer&) { set_dispatch(mode); });
+        }
+        if (ImGui::Checkbox("Packet camera rays", &packet_tracing)) {
+            bool enabled = packet_tracing;
+            renderThread.submit([enabled](Renderer& r) { r.setPacketTracing(enabled); });
+        }
+        ImGui::Text("Build: %.2f ms, %d nodes, %d leaves, depth %d", stats.accel.buildMs, stats.accel.nodes,
+                    stats.accel.leaves, stats.accel.maxDepth);
+        ImGui::Text("SAH cost: %.1f, refit %.3f ms, %d rebuilds", stats.accel.sahCost, stats.accel.lastRefitMs,
+                    stats.accel.rebuilds);
+        double traversed = std::max(stats.traversal.rays, 1LL);
+        ImGui::Text("Per ray: %.1f nodes, %.1f prims", stats.traversal.nodes / traversed, stats.traversal.prims / traversed);
         ImGui::End();
 
         
         ImGui::Begin("Object Controls");
-        std::shared_ptr<material> mat_lam;
-        for(int i = 0; i < world.length(); i++){
-            auto obj = world.get(i);
-            auto sphere_ptr = std::dynamic_pointer_cast<sphere>(obj);
-
-            if (sphere_ptr) {
-                vec3 pos = sphere_ptr->get_center();
-                ImGui::SliderFloat3(("Position##" + std::to_string(i)).c_str(), &(pos[0]), -10.0f, 10.0f);
-                sphere_ptr->set_center(pos);
-
-                auto mat = sphere_ptr->get_material();
-                if (auto lam = std::dynamic_pointer_cast<lambertian>(mat)) {
-                    color col = lam->get_albedo();
-                    ImGui::ColorEdit3(("Color##" + std::to_string(i)).c_str(), &col[0]);
-                    lam->set_albedo(col);
-                } else if (auto met = std::dynamic_pointer_cast<metal>(mat)) {
-                    color col = met->get_albedo();
-                    ImGui::ColorEdit3(("Color##" + std::to_string(i)).c_str(), &col[0]);
-                    met->set_albedo(col);
+        for(size_t i = 0; i < controls.size(); i++){
+            ObjectControl& ctrl = controls[i];
+            shared_ptr<sphere> obj = ctrl.obj;
+            int index = ctrl.index;
+
+            if (ImGui::SliderFloat3(("Position##" + std::to_string(i)).c_str(), &(ctrl.center[0]), -10.0f, 10.0f)) {
+                vec3 pos = ctrl.center;
+                renderThread.submit([obj, index, pos](Renderer& r) {
+                    obj->set_center(pos);
+                    r.geometryChanged(index);
+                });
+            }
+
+            if (ctrl.hasAlbedo) {
+                if (ImGui::ColorEdit3(("Color##" + std::to_string(i)).c_str(), &(ctrl.albedo[0]))) {
+                    uint32_t mat = ctrl.mat;
+                    color col = ctrl.albedo;
+                    renderThread.submit([mat, col](Renderer& r) {
+                        shared_ptr<material> edited = r.getMaterials().get(mat);
+                        if (edited->type() == MaterialType::Lambertian)
+                            std::static_pointer_cast<lambertian>(edited)->set_albedo(col);
+                        else
+                            std::static_pointer_cast<metal>(edited)->set_albedo(col);
+                        r.resetAccumulation();
+                    });
                 }
             }
         }
@@ -184,13 +324,7 @@ int main(){
 
         // Update the camera based on the User input
         cam.set_camera(camera_position, camera_target, vec3(0, 1, 0), 90.0f, aspect_ratio);
-        renderer.updateCamera(cam);
-
-        renderer.renderScene();
-
-        // Update the texture with the ray tracing result
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, img_width, img_height, GL_RGB, GL_UNSIGNED_BYTE, renderer.getPixels().data());
+        renderThread.setCamera(cam);
 
         // Render the texture using ImGui
         ImGui::Begin("Ray Traced Image");
@@ -207,6 +341,8 @@ int main(){
         glfwSwapBuffers(window);
     }
 
+    renderThread.stop();
+
     glDeleteTextures(1, &texture);
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();